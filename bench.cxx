@@ -0,0 +1,1157 @@
+#include "filetransport.h"
+#include "framestream.h"
+#include "messagequeue.h"
+#include "reclaimer.h"
+#include "shmtransport.h"
+#include "test.h"
+#include "validation.h"
+#include <sys/wait.h>
+#include <benchmark/benchmark.h>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <thread>
+#include <utility>
+
+// Benchmarks of the allocator and adoption layer, "make bench". Payload sizes are given in number of elements
+// unless stated otherwise, the templated ones are instantiated for a few element types.
+
+#define BENCHMARK_ELEMENT_TYPES(bm, ...)                 \
+  BENCHMARK_TEMPLATE(bm, char)->__VA_ARGS__;             \
+  BENCHMARK_TEMPLATE(bm, uint32_t)->__VA_ARGS__;         \
+  BENCHMARK_TEMPLATE(bm, double)->__VA_ARGS__;           \
+  BENCHMARK_TEMPLATE(bm, elem)->__VA_ARGS__
+
+template <typename T>
+static void setCounters(benchmark::State& state, size_t nelem)
+{
+  state.SetItemsProcessed(state.iterations() * nelem);
+  state.SetBytesProcessed(state.iterations() * nelem * sizeof(T));
+}
+
+//__________________________________________________________________________________________________
+// allocate and release one buffer while state.range(0) other messages are alive in the same resource
+static void BM_ChannelResourceAllocateRelease(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  std::vector<void*> live(state.range(0));
+  for (auto& p : live) {
+    p = resource.allocate(64);
+  }
+  // one round outside of the timing, so a registry growth step at exactly N+1 is not measured
+  resource.deallocate(resource.allocate(64), 64);
+  for (auto _ : state) {
+    void* p = resource.allocate(64);
+    benchmark::DoNotOptimize(p);
+    resource.deallocate(p, 64);
+  }
+  state.counters["live"] = resource.getNumberOfMessages();
+  for (auto p : live) {
+    resource.deallocate(p, 64);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ChannelResourceAllocateRelease)->RangeMultiplier(8)->Range(1, 1 << 20);
+
+//__________________________________________________________________________________________________
+// registry only: take a message out of the resource and put it back, no message is created or destroyed
+static void BM_ChannelResourceGetSetMessage(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  std::vector<void*> live(state.range(0));
+  for (auto& p : live) {
+    p = resource.allocate(64);
+  }
+  size_t i = 0;
+  for (auto _ : state) {
+    auto message = resource.getMessage(live[i]);
+    live[i] = resource.setMessage(std::move(message));
+    if (++i == live.size()) {
+      i = 0;
+    }
+  }
+  state.counters["live"] = resource.getNumberOfMessages();
+  for (auto p : live) {
+    resource.deallocate(p, 64);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ChannelResourceGetSetMessage)->RangeMultiplier(8)->Range(1, 1 << 20);
+
+//__________________________________________________________________________________________________
+// every thread allocates from its own shard of the transport allocator map, nothing should serialize
+static void BM_TransportAllocatorThreads(benchmark::State& state)
+{
+  static FairMQTransportFactory factory;
+  for (auto _ : state) {
+    ChannelResource* resource = getTransportAllocator(&factory);
+    void* p = resource->allocate(64);
+    benchmark::DoNotOptimize(p);
+    resource->deallocate(p, 64);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_TransportAllocatorThreads)->ThreadRange(1, 8)->UseRealTime();
+
+//__________________________________________________________________________________________________
+// fan-out: state.range(0) header+payload pairs into one FairMQParts, one allocation per buffer (range(1) == 0)
+// or one batch call for all of them (range(1) == 1)
+static void BM_BuildParts(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  const size_t n = 2 * state.range(0);
+  const bool batch = state.range(1);
+  std::vector<size_t> sizes(n);
+  for (size_t i = 0; i < n; ++i) {
+    sizes[i] = i % 2 ? 1024 : sizeof(DataHeader);
+  }
+  std::vector<void*> buffers(n);
+  for (auto _ : state) {
+    FairMQParts parts;
+    if (batch) {
+      resource.allocateBatch(sizes.data(), n, buffers.data());
+      resource.getMessages(buffers.data(), n, parts);
+    }
+    else {
+      for (size_t i = 0; i < n; ++i) {
+        buffers[i] = resource.allocate(sizes[i]);
+      }
+      for (size_t i = 0; i < n; ++i) {
+        parts.AddPart(resource.getMessage(buffers[i]));
+      }
+    }
+    benchmark::DoNotOptimize(parts.fParts.data());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.SetLabel(batch ? "batch" : "single");
+}
+BENCHMARK(BM_BuildParts)->ArgsProduct({ { 1, 16, 256 }, { 0, 1 } });
+
+//__________________________________________________________________________________________________
+template <typename T>
+static void BM_ChannelResourceAllocate(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  const size_t nelem = state.range(0);
+  for (auto _ : state) {
+    void* p = resource.allocate(nelem * sizeof(T), alignof(T));
+    benchmark::DoNotOptimize(p);
+    resource.deallocate(p, nelem * sizeof(T), alignof(T));
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_ELEMENT_TYPES(BM_ChannelResourceAllocate, RangeMultiplier(64)->Range(1, 1 << 24));
+
+//__________________________________________________________________________________________________
+// vector on the channel resource, message handed out on the same resource: a registry lookup
+template <typename T>
+static void BM_GetMessageSameResource(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  const size_t nelem = state.range(0);
+  for (auto _ : state) {
+    std::vector<T, SpectatorAllocator<T>> vector(nelem, SpectatorAllocator<T>{ &resource });
+    auto message = getMessage(std::move(vector));
+    benchmark::DoNotOptimize(message->GetData());
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_ELEMENT_TYPES(BM_GetMessageSameResource, RangeMultiplier(64)->Range(1, 1 << 24));
+
+//__________________________________________________________________________________________________
+// hand a vector built on one channel's resource out through another transport
+template <typename T>
+static void BM_GetMessageCrossResource(benchmark::State& state)
+{
+  FairMQTransportFactory sourceFactory;
+  FairMQTransportFactory targetFactory;
+  ChannelResource source(&sourceFactory);
+  ChannelResource target(&targetFactory);
+  const size_t nelem = state.range(0);
+  size_t copies = getMessageCopyFallbacks();
+  for (auto _ : state) {
+    std::vector<T, SpectatorAllocator<T>> vector(nelem, SpectatorAllocator<T>{ &source });
+    auto message = getMessage(std::move(vector), &target);
+    benchmark::DoNotOptimize(message->GetData());
+  }
+  state.counters["copies"] = getMessageCopyFallbacks() - copies;
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_ELEMENT_TYPES(BM_GetMessageCrossResource, RangeMultiplier(64)->Range(1, 1 << 24));
+
+//__________________________________________________________________________________________________
+// adoptVector(nelem, FairMQMemoryResource*): watch a message through a SpectatorMessageResource
+template <typename T>
+static void BM_AdoptVectorSpectator(benchmark::State& state)
+{
+  const size_t nelem = state.range(0);
+  FairMQMessage message(nelem * sizeof(T));
+  for (auto _ : state) {
+    SpectatorMessageResource resource(&message);
+    auto vector = adoptVector<T>(nelem, &resource);
+    benchmark::DoNotOptimize(vector.data());
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_ELEMENT_TYPES(BM_AdoptVectorSpectator, RangeMultiplier(64)->Range(1, 1 << 24));
+
+//__________________________________________________________________________________________________
+// adoptVector(nelem, upstream, FairMQMessagePtr): take ownership of the message and give it back with getMessage
+template <typename T>
+static void BM_AdoptVectorOwning(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  const size_t nelem = state.range(0);
+  auto message = factory.CreateMessage(nelem * sizeof(T));
+  for (auto _ : state) {
+    auto vector = adoptVector<T>(nelem, &resource, std::move(message));
+    benchmark::DoNotOptimize(vector.data());
+    message = getMessage(std::move(vector));
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_ELEMENT_TYPES(BM_AdoptVectorOwning, RangeMultiplier(64)->Range(1, 1 << 24));
+
+// the same round trip with the adopted vector moved around on the way, as when it is passed through a pipeline
+template <typename T>
+static void BM_AdoptVectorOwningMove(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  const size_t nelem = state.range(0);
+  auto message = factory.CreateMessage(nelem * sizeof(T));
+  for (auto _ : state) {
+    auto vector = adoptVector<T>(nelem, &resource, std::move(message));
+    auto moved = std::move(vector);
+    decltype(moved) assigned;
+    assigned = std::move(moved);
+    benchmark::DoNotOptimize(assigned.data());
+    message = getMessage(std::move(assigned));
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_ELEMENT_TYPES(BM_AdoptVectorOwningMove, RangeMultiplier(64)->Range(1, 1 << 24));
+
+//__________________________________________________________________________________________________
+// adoptVector(nelem, FairMQMessage*): unique_ptr to a const vector watching the message
+template <typename T>
+static void BM_AdoptVectorPointer(benchmark::State& state)
+{
+  const size_t nelem = state.range(0);
+  FairMQMessage message(nelem * sizeof(T));
+  for (auto _ : state) {
+    auto vector = adoptVector<T>(nelem, &message);
+    benchmark::DoNotOptimize(vector->data());
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_ELEMENT_TYPES(BM_AdoptVectorPointer, RangeMultiplier(64)->Range(1, 1 << 24));
+
+//__________________________________________________________________________________________________
+// the MessageView counterparts of the above, only for trivially copyable types
+#define BENCHMARK_TRIVIAL_ELEMENT_TYPES(bm, ...)         \
+  BENCHMARK_TEMPLATE(bm, char)->__VA_ARGS__;             \
+  BENCHMARK_TEMPLATE(bm, uint32_t)->__VA_ARGS__;         \
+  BENCHMARK_TEMPLATE(bm, double)->__VA_ARGS__
+
+template <typename T>
+static void BM_AdoptViewSpectator(benchmark::State& state)
+{
+  const size_t nelem = state.range(0);
+  FairMQMessage message(nelem * sizeof(T));
+  for (auto _ : state) {
+    SpectatorMessageResource resource(&message);
+    auto view = adoptView<T>(nelem, &resource);
+    benchmark::DoNotOptimize(view.data());
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_TRIVIAL_ELEMENT_TYPES(BM_AdoptViewSpectator, RangeMultiplier(64)->Range(1, 1 << 24));
+
+template <typename T>
+static void BM_AdoptViewOwning(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  const size_t nelem = state.range(0);
+  auto message = factory.CreateMessage(nelem * sizeof(T));
+  for (auto _ : state) {
+    auto view = adoptView<T>(nelem, &resource, std::move(message));
+    benchmark::DoNotOptimize(view.data());
+    message = getMessage(std::move(view));
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_TRIVIAL_ELEMENT_TYPES(BM_AdoptViewOwning, RangeMultiplier(64)->Range(1, 1 << 24));
+
+template <typename T>
+static void BM_AdoptViewPointer(benchmark::State& state)
+{
+  const size_t nelem = state.range(0);
+  FairMQMessage message(nelem * sizeof(T));
+  for (auto _ : state) {
+    auto view = adoptView<T>(nelem, &message);
+    benchmark::DoNotOptimize(view.data());
+  }
+  setCounters<T>(state, nelem);
+}
+BENCHMARK_TRIVIAL_ELEMENT_TYPES(BM_AdoptViewPointer, RangeMultiplier(64)->Range(1, 1 << 24));
+
+//__________________________________________________________________________________________________
+template <size_t... Is>
+static Stack makeStack(std::index_sequence<Is...>,
+                       Stack::allocator_type allocator = boost::container::pmr::new_delete_resource())
+{
+  return Stack(allocator, (static_cast<void>(Is), DataHeader{})...);
+}
+
+template <size_t N>
+static void BM_StackConstruct(benchmark::State& state)
+{
+  for (auto _ : state) {
+    auto stack = makeStack(std::make_index_sequence<N>{});
+    benchmark::DoNotOptimize(stack.data());
+  }
+  state.SetItemsProcessed(state.iterations() * N);
+  state.SetBytesProcessed(state.iterations() * N * sizeof(DataHeader));
+}
+BENCHMARK_TEMPLATE(BM_StackConstruct, 1);
+BENCHMARK_TEMPLATE(BM_StackConstruct, 2);
+BENCHMARK_TEMPLATE(BM_StackConstruct, 4);
+BENCHMARK_TEMPLATE(BM_StackConstruct, 8);
+BENCHMARK_TEMPLATE(BM_StackConstruct, 16);
+
+//__________________________________________________________________________________________________
+template <size_t N>
+static void BM_HeaderChainWalk(benchmark::State& state)
+{
+  auto stack = makeStack(std::make_index_sequence<N>{});
+  for (auto _ : state) {
+    size_t count = 0;
+    for (const BaseHeader* h = BaseHeader::get(stack.data()); h; h = h->next()) {
+      ++count;
+    }
+    benchmark::DoNotOptimize(count);
+  }
+  state.SetItemsProcessed(state.iterations() * N);
+  state.SetBytesProcessed(state.iterations() * stack.size());
+}
+BENCHMARK_TEMPLATE(BM_HeaderChainWalk, 1);
+BENCHMARK_TEMPLATE(BM_HeaderChainWalk, 2);
+BENCHMARK_TEMPLATE(BM_HeaderChainWalk, 4);
+BENCHMARK_TEMPLATE(BM_HeaderChainWalk, 8);
+BENCHMARK_TEMPLATE(BM_HeaderChainWalk, 16);
+
+//__________________________________________________________________________________________________
+// build a header stack and hand it to a message, as done for every outgoing message. Stacks up to
+// Stack::inlineCapacity() (one or two DataHeaders by default) are inline, compare with -DFAKEMQ_STACK_INLINE_BYTES=0
+template <size_t N>
+static void BM_StackToMessage(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource* target = getTransportAllocator(&factory);
+  const bool arena = state.range(0);
+  HeaderArenaResource* resource = HeaderArenaResource::threadLocal();
+  for (auto _ : state) {
+    {
+      auto stack = arena ? makeStack(std::make_index_sequence<N>{}, resource) : makeStack(std::make_index_sequence<N>{});
+      auto message = getMessage(std::move(stack), target);
+      benchmark::DoNotOptimize(message->GetData());
+    }
+    if (arena) {
+      resource->newCycle();
+    }
+  }
+  if (arena) {
+    auto stats = resource->getStats();
+    state.counters["blocks"] = stats.blocks;
+    state.counters["peakUsed"] = stats.peakUsed;
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(Stack::inlineCapacity() >= N * sizeof(DataHeader) ? "inline" : arena ? "thread arena" : "new_delete");
+}
+BENCHMARK_TEMPLATE(BM_StackToMessage, 1)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_StackToMessage, 2)->Arg(0)->Arg(1);
+BENCHMARK_TEMPLATE(BM_StackToMessage, 4)->Arg(0)->Arg(1);
+
+//__________________________________________________________________________________________________
+struct TraceHeader : public BaseHeader {
+  static constexpr HeaderType headerType() noexcept { return HeaderType{ "Trace" }; }
+  uint64_t timestamp{ 0 };
+  TraceHeader() noexcept : BaseHeader{ sizeof(TraceHeader), headerType() } {}
+};
+
+// find the header at the end of a stack of N headers: bounds checked walk vs a prebuilt index
+template <size_t N>
+static void BM_HeaderGet(benchmark::State& state)
+{
+  Stack stack(makeStack(std::make_index_sequence<N - 1>{}), TraceHeader{});
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(get<TraceHeader>(stack.data(), stack.size()));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_HeaderGet, 2);
+BENCHMARK_TEMPLATE(BM_HeaderGet, 4);
+BENCHMARK_TEMPLATE(BM_HeaderGet, 16);
+
+template <size_t N>
+static void BM_HeaderIndexGet(benchmark::State& state)
+{
+  Stack stack(makeStack(std::make_index_sequence<N - 1>{}), TraceHeader{});
+  HeaderIndex index(stack.data(), stack.size());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(index.get<TraceHeader>());
+    benchmark::DoNotOptimize(index.get<DataHeader>());
+  }
+  state.SetItemsProcessed(2 * state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_HeaderIndexGet, 2);
+BENCHMARK_TEMPLATE(BM_HeaderIndexGet, 4);
+BENCHMARK_TEMPLATE(BM_HeaderIndexGet, 16);
+
+//__________________________________________________________________________________________________
+// build a vector of state.range(0) ints on the resource and take its message out, the message dies right away
+template <typename ResourceT>
+static void BM_VectorBuildGetMessage(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ResourceT resource(&factory);
+  const int nelem = state.range(0);
+  for (auto _ : state) {
+    std::vector<int, SpectatorAllocator<int>> vector(SpectatorAllocator<int>{ &resource });
+    vector.reserve(nelem);
+    for (int i = 0; i < nelem; ++i) {
+      vector.push_back(i);
+    }
+    auto message = getMessage(std::move(vector));
+    benchmark::DoNotOptimize(message->GetData());
+  }
+  state.SetBytesProcessed(state.iterations() * nelem * sizeof(int));
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_VectorBuildGetMessage, ChannelResource)->RangeMultiplier(8)->Range(8, 1 << 18);
+BENCHMARK_TEMPLATE(BM_VectorBuildGetMessage, MessagePoolResource)->RangeMultiplier(8)->Range(8, 1 << 18);
+
+//__________________________________________________________________________________________________
+// append state.range(0) ints without reserving up front and take the message out
+static void BM_AppendSpectatorVector(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  const int nelem = state.range(0);
+  for (auto _ : state) {
+    std::vector<int, SpectatorAllocator<int>> vector(SpectatorAllocator<int>{ &resource });
+    for (int i = 0; i < nelem; ++i) {
+      vector.push_back(i);
+    }
+    auto message = getMessage(std::move(vector));
+    benchmark::DoNotOptimize(message->GetData());
+  }
+  state.SetBytesProcessed(state.iterations() * nelem * sizeof(int));
+}
+BENCHMARK(BM_AppendSpectatorVector)->RangeMultiplier(16)->Range(1 << 10, 1 << 24);
+
+static void BM_AppendGrowableMessageVector(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  const int nelem = state.range(0);
+  for (auto _ : state) {
+    GrowableMessageVector<int> vector(&resource);
+    for (int i = 0; i < nelem; ++i) {
+      vector.push_back(i);
+    }
+    auto message = getMessage(std::move(vector));
+    benchmark::DoNotOptimize(message->GetData());
+  }
+  state.SetBytesProcessed(state.iterations() * nelem * sizeof(int));
+}
+BENCHMARK(BM_AppendGrowableMessageVector)->RangeMultiplier(16)->Range(1 << 10, 1 << 24);
+
+//__________________________________________________________________________________________________
+// sequential scan over a vector adopting a message backed according to the MessageBacking in state.range(0)
+static void BM_ScanAdoptedVector(benchmark::State& state)
+{
+  MemoryPolicy policy;
+  policy.backing = static_cast<MessageBacking>(state.range(0));
+  policy.nearCallingThread = true;
+  FairMQTransportFactory factory(policy);
+  const size_t nelem = state.range(1) / sizeof(uint64_t);
+  auto message = factory.CreateMessage(nelem * sizeof(uint64_t));
+  std::memset(message->GetData(), 1, nelem * sizeof(uint64_t)); // first touch
+  SpectatorMessageResource resource(message.get());
+  auto vector = adoptVector<uint64_t>(nelem, &resource);
+  for (auto _ : state) {
+    uint64_t sum = 0;
+    for (auto value : vector) {
+      sum += value;
+    }
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetBytesProcessed(state.iterations() * nelem * sizeof(uint64_t));
+  state.SetLabel(policy.backing == MessageBacking::Heap
+                   ? "heap"
+                   : policy.backing == MessageBacking::Mmap
+                       ? "mmap"
+                       : policy.backing == MessageBacking::TransparentHugePages ? "thp" : "hugetlb");
+}
+BENCHMARK(BM_ScanAdoptedVector)
+  ->ArgsProduct({ { static_cast<int>(MessageBacking::Heap), static_cast<int>(MessageBacking::Mmap),
+                    static_cast<int>(MessageBacking::TransparentHugePages),
+                    static_cast<int>(MessageBacking::ExplicitHugePages) },
+                  { 1 << 20, 1 << 24, 1 << 28 } });
+
+//__________________________________________________________________________________________________
+// creating and destroying a message should not depend on its size, nothing touches the buffer
+static void BM_MessageCreateDestroy(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  const size_t nbytes = state.range(0);
+  for (auto _ : state) {
+    auto message = factory.CreateMessage(nbytes);
+    benchmark::DoNotOptimize(message->GetData());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MessageCreateDestroy)->RangeMultiplier(16)->Range(64, 1 << 28);
+
+//__________________________________________________________________________________________________
+// one way latency of a single message in flight between two threads: the producer waits until the consumer got
+// the previous one, the consumer records how long each message spent between push and pop
+template <typename QueueT>
+static void BM_QueueLatency(benchmark::State& state)
+{
+  using clock = std::chrono::steady_clock;
+  QueueT queue(1024);
+  std::atomic<size_t> received{ 0 };
+  std::vector<int64_t> latencies;
+  latencies.reserve(1 << 20);
+  std::thread consumer([&] {
+    for (;;) {
+      FairMQMessagePtr message;
+      while (!queue.tryPop(message)) {
+        std::this_thread::yield();
+      }
+      auto now = clock::now().time_since_epoch().count();
+      if (!message) {
+        return;
+      }
+      int64_t sent;
+      std::memcpy(&sent, message->GetData(), sizeof(sent));
+      if (latencies.size() < latencies.capacity()) {
+        latencies.push_back(now - sent);
+      }
+      received.fetch_add(1, std::memory_order_release);
+    }
+  });
+  size_t sent = 0;
+  for (auto _ : state) {
+    auto message = std::make_unique<FairMQMessage>(sizeof(int64_t));
+    int64_t now = clock::now().time_since_epoch().count();
+    std::memcpy(message->GetData(), &now, sizeof(now));
+    queue.push(std::move(message));
+    ++sent;
+    while (received.load(std::memory_order_acquire) != sent) {
+      std::this_thread::yield();
+    }
+  }
+  queue.push(nullptr);
+  consumer.join();
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) {
+    return latencies.empty() ? 0. : static_cast<double>(latencies[static_cast<size_t>(p * (latencies.size() - 1))]);
+  };
+  state.counters["p50_ns"] = percentile(0.5);
+  state.counters["p99_ns"] = percentile(0.99);
+  state.counters["p999_ns"] = percentile(0.999);
+  state.counters["max_ns"] = percentile(1.);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK_TEMPLATE(BM_QueueLatency, SPSCMessageQueue)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_QueueLatency, MPMCMessageQueue)->UseRealTime();
+
+//__________________________________________________________________________________________________
+// throughput with the benchmark threads split into producers (even) and consumers (odd), state.range(0) messages
+// per push/pop call. With a single thread it pushes and pops in turn.
+template <typename QueueT>
+static void BM_QueueThroughput(benchmark::State& state)
+{
+  static QueueT queue(1024);
+  const size_t batch = state.range(0);
+  const bool single = state.threads() == 1;
+  const bool producer = state.thread_index() % 2 == 0;
+  std::vector<FairMQMessagePtr> messages(batch);
+  for (auto _ : state) {
+    if (single || producer) {
+      for (auto& message : messages) {
+        message = std::make_unique<FairMQMessage>(nullptr, 0, nullptr);
+      }
+      queue.push(messages.data(), batch);
+    }
+    if (single || !producer) {
+      queue.pop(messages.data(), batch);
+      for (auto& message : messages) {
+        message = nullptr;
+      }
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * batch);
+}
+BENCHMARK_TEMPLATE(BM_QueueThroughput, SPSCMessageQueue)->Arg(1)->Arg(32)->Threads(1)->Threads(2)->UseRealTime();
+BENCHMARK_TEMPLATE(BM_QueueThroughput, MPMCMessageQueue)
+  ->Arg(1)
+  ->Arg(32)
+  ->Threads(1)
+  ->DenseThreadRange(2, 64, 2)
+  ->UseRealTime();
+
+//__________________________________________________________________________________________________
+// a vector built on one thread, adopted on another one: only the message pointer crosses
+static void BM_QueueHandOverVector(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource resource(&factory);
+  SPSCMessageQueue queue(64);
+  const size_t nelem = state.range(0);
+  std::atomic<bool> done{ false };
+  std::thread consumer([&] {
+    uint64_t sum = 0;
+    for (;;) {
+      FairMQMessagePtr message;
+      while (!queue.tryPop(message)) {
+        std::this_thread::yield();
+        if (done.load(std::memory_order_acquire) && queue.empty()) {
+          benchmark::DoNotOptimize(sum);
+          return;
+        }
+      }
+      size_t received = message->GetUsedSize() / sizeof(uint64_t);
+      auto view = MessageView<uint64_t>(received, std::move(message));
+      sum += view.back();
+    }
+  });
+  for (auto _ : state) {
+    std::vector<uint64_t, SpectatorAllocator<uint64_t>> vector(SpectatorAllocator<uint64_t>{ &resource });
+    vector.reserve(nelem);
+    for (size_t i = 0; i < nelem; ++i) {
+      vector.push_back(i);
+    }
+    pushContainer(queue, std::move(vector));
+  }
+  done.store(true, std::memory_order_release);
+  consumer.join();
+  setCounters<uint64_t>(state, nelem);
+}
+BENCHMARK(BM_QueueHandOverVector)->RangeMultiplier(64)->Range(1, 1 << 18)->UseRealTime();
+
+//__________________________________________________________________________________________________
+// broadcast one frame of state.range(0) bytes to state.range(1) consumers: a copy per consumer (range(2) == 0)
+// or one shared buffer (range(2) == 1), each consumer reads it through an adopted vector
+static void BM_FanOut(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  auto channel = getTransportAllocator(&factory);
+  const size_t nbytes = state.range(0);
+  const size_t consumers = state.range(1);
+  const bool shared = state.range(2);
+  auto message = factory.CreateMessage(nbytes);
+  std::memset(message->GetData(), 1, nbytes);
+  SharedMessage frame(std::move(message), &factory);
+  std::vector<FairMQMessagePtr> outgoing(consumers);
+  for (auto _ : state) {
+    SharedMessageResource resource(frame);
+    for (auto& out : outgoing) {
+      if (shared) {
+        auto vector = adoptVector<char>(nbytes, &resource);
+        benchmark::DoNotOptimize(vector.back());
+        out = getMessage(std::move(vector));
+      }
+      else {
+        auto copy = factory.CreateMessage(nbytes);
+        std::memcpy(copy->GetData(), frame.data(), nbytes);
+        auto vector = adoptVector<char>(nbytes, channel, std::move(copy));
+        benchmark::DoNotOptimize(vector.back());
+        out = getMessage(std::move(vector));
+      }
+    }
+    for (auto& out : outgoing) {
+      out = nullptr;
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * consumers);
+  state.SetBytesProcessed(state.iterations() * consumers * nbytes);
+  state.SetLabel(shared ? "shared" : "copy");
+}
+BENCHMARK(BM_FanOut)->ArgsProduct({ { 1 << 20, 1 << 24 }, { 2, 8 }, { 0, 1 } })->Unit(benchmark::kMicrosecond);
+
+//__________________________________________________________________________________________________
+// time the hot thread spends dropping an adopted vector of state.range(0) mapped bytes (the free is an munmap),
+// freed on the spot (range(1) == 0) or queued to a BackgroundReclaimer (range(1) == 1)
+static void BM_DeferredRelease(benchmark::State& state)
+{
+  FairMQTransportFactory factory;
+  ChannelResource channel{ &factory };
+  const size_t nbytes = state.range(0);
+  const bool deferred = state.range(1);
+  BackgroundReclaimer reclaimer{ ReclaimerOptions{ 16, 0, true } };
+  if (deferred) {
+    channel.setReclaimer(&reclaimer);
+  }
+  for (auto _ : state) {
+    auto message = factory.CreateMessage(nbytes, MemoryPolicy{ MessageBacking::Mmap });
+    std::memset(message->GetData(), 1, nbytes);
+    auto vector = adoptVector<char>(nbytes, &channel, std::move(message));
+    benchmark::DoNotOptimize(vector.back());
+    auto start = std::chrono::steady_clock::now();
+    vector = decltype(vector){};
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    state.SetIterationTime(std::chrono::duration<double>(elapsed).count());
+  }
+  reclaimer.drain();
+  state.SetItemsProcessed(state.iterations());
+  state.SetLabel(deferred ? "deferred" : "inline");
+}
+BENCHMARK(BM_DeferredRelease)->ArgsProduct({ { 1 << 12, 1 << 16, 1 << 22 }, { 0, 1 } })->UseManualTime();
+
+//__________________________________________________________________________________________________
+// replay a recording of 256 MiB in records of two parts of state.range(0) bytes and sum up every payload: mapped
+// with the MappedFileTransportFactory (range(1) == 1) or read() into heap messages record by record (range(1) == 0)
+static void BM_FileReplay(benchmark::State& state)
+{
+  const size_t nbytes = state.range(0);
+  const bool mapped = state.range(1);
+  const size_t nrecords = (size_t{ 256 } << 20) / (2 * nbytes);
+  const std::string path = "/tmp/fakemq-bench-replay.bin";
+  FairMQTransportFactory factory;
+  {
+    FairMQPartsWriter writer(path);
+    FairMQParts parts;
+    parts.AddPart(factory.CreateMessage(nbytes));
+    parts.AddPart(factory.CreateMessage(nbytes));
+    std::memset(parts[0].GetData(), 1, nbytes);
+    std::memset(parts[1].GetData(), 2, nbytes);
+    for (size_t i = 0; i < nrecords; ++i) {
+      writer.Write(parts);
+    }
+  }
+  auto sum = [](const FairMQMessage& message) {
+    auto words = static_cast<const uint64_t*>(message.GetData());
+    return std::accumulate(words, words + message.GetSize() / sizeof(uint64_t), uint64_t{ 0 });
+  };
+  for (auto _ : state) {
+    uint64_t total = 0;
+    if (mapped) {
+      MappedFileTransportFactory replay(path);
+      FairMQParts parts;
+      while (replay.Receive(parts)) {
+        total += sum(parts[0]) + sum(parts[1]);
+        parts = FairMQParts{};
+      }
+    }
+    else {
+      int fd = open(path.c_str(), O_RDONLY);
+      internal::RecordFileHeader file;
+      ssize_t ok = read(fd, &file, sizeof(file));
+      off_t offset = internal::alignUp(sizeof(file), file.alignment);
+      internal::RecordHeader header;
+      while (ok > 0 && pread(fd, &header, sizeof(header), offset) == sizeof(header)) {
+        std::vector<uint64_t> sizes(header.parts);
+        pread(fd, sizes.data(), sizes.size() * sizeof(uint64_t), offset + sizeof(header));
+        off_t payload = internal::alignUp(offset + sizeof(header) + sizes.size() * sizeof(uint64_t), file.alignment);
+        FairMQParts parts;
+        for (auto size : sizes) {
+          auto message = factory.CreateMessage(size);
+          pread(fd, message->GetData(), size, payload);
+          total += sum(*message);
+          parts.AddPart(std::move(message));
+          payload = internal::alignUp(payload + size, file.alignment);
+        }
+        offset += header.bytes;
+      }
+      close(fd);
+    }
+    benchmark::DoNotOptimize(total);
+  }
+  unlink(path.c_str());
+  state.SetItemsProcessed(state.iterations() * nrecords);
+  state.SetBytesProcessed(state.iterations() * nrecords * 2 * nbytes);
+  state.SetLabel(mapped ? "mapped" : "read");
+}
+BENCHMARK(BM_FileReplay)->ArgsProduct({ { 1 << 12, 1 << 20 }, { 0, 1 } })->Unit(benchmark::kMillisecond);
+
+//__________________________________________________________________________________________________
+// stream 64 MiB of (Stack, payload) frames with payloads of state.range(0) bytes to a file: the batching FrameWriter
+// (range(1) == 1) or the same format written with one write() per frame part (range(1) == 0)
+static void BM_FrameStreamWrite(benchmark::State& state)
+{
+  const size_t nbytes = state.range(0);
+  const bool batched = state.range(1);
+  const size_t nframes = (size_t{ 64 } << 20) / nbytes;
+  const std::string path = "/tmp/fakemq-bench-frames.bin";
+  FairMQTransportFactory factory;
+  Stack headers{ DataHeader{} };
+  auto payload = factory.CreateMessage(nbytes);
+  std::memset(payload->GetData(), 1, nbytes);
+  for (auto _ : state) {
+    if (batched) {
+      FrameWriter writer(path);
+      for (size_t i = 0; i < nframes; ++i) {
+        writer.Write(headers, *payload);
+      }
+    }
+    else {
+      int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+      internal::StreamHeader stream{ internal::streamMagic, internal::streamVersion, 16, {} };
+      ssize_t ok = write(fd, &stream, sizeof(stream));
+      internal::FrameLayout layout(headers.size(), nbytes, 16);
+      internal::FrameHeader frame{ internal::frameMagic, 0, headers.size(), nbytes, layout.bytes };
+      for (size_t i = 0; ok > 0 && i < nframes; ++i) {
+        write(fd, &frame, sizeof(frame));
+        write(fd, internal::zeroPadding(), layout.header - sizeof(frame));
+        write(fd, headers.data(), headers.size());
+        write(fd, internal::zeroPadding(), layout.payload - layout.header - headers.size());
+        write(fd, payload->GetData(), nbytes);
+        write(fd, internal::zeroPadding(), layout.bytes - layout.payload - nbytes);
+      }
+      close(fd);
+    }
+  }
+  unlink(path.c_str());
+  state.SetItemsProcessed(state.iterations() * nframes);
+  state.SetBytesProcessed(state.iterations() * nframes * nbytes);
+  state.SetLabel(batched ? "batched" : "per frame");
+}
+BENCHMARK(BM_FrameStreamWrite)->ArgsProduct({ { 256, 4096, 1 << 20 }, { 0, 1 } })->Unit(benchmark::kMillisecond);
+
+// read the frames back and touch every payload: the FrameReader's shared chunks (range(1) == 1) or a read() per
+// frame part into new heap messages (range(1) == 0)
+static void BM_FrameStreamRead(benchmark::State& state)
+{
+  const size_t nbytes = state.range(0);
+  const bool chunked = state.range(1);
+  const size_t nframes = (size_t{ 64 } << 20) / nbytes;
+  const std::string path = "/tmp/fakemq-bench-frames.bin";
+  FairMQTransportFactory factory;
+  {
+    Stack headers{ DataHeader{} };
+    auto payload = factory.CreateMessage(nbytes);
+    std::memset(payload->GetData(), 1, nbytes);
+    FrameWriter writer(path);
+    for (size_t i = 0; i < nframes; ++i) {
+      writer.Write(headers, *payload);
+    }
+  }
+  for (auto _ : state) {
+    size_t total = 0;
+    if (chunked) {
+      FrameReader reader(path);
+      Frame frame;
+      while (reader.Read(frame)) {
+        total += static_cast<const byte*>(frame.payload->GetData())[frame.payload->GetSize() - 1] != static_cast<byte>(0);
+      }
+    }
+    else {
+      int fd = open(path.c_str(), O_RDONLY);
+      internal::StreamHeader stream;
+      internal::FrameHeader frame;
+      ssize_t ok = read(fd, &stream, sizeof(stream));
+      byte padding[16];
+      while (ok > 0 && read(fd, &frame, sizeof(frame)) == sizeof(frame) && frame.magic == internal::frameMagic) {
+        internal::FrameLayout layout(frame.headerBytes, frame.payloadBytes, stream.alignment);
+        auto header = factory.CreateMessage(frame.headerBytes);
+        auto payload = factory.CreateMessage(frame.payloadBytes);
+        read(fd, padding, layout.header - sizeof(frame));
+        read(fd, header->GetData(), frame.headerBytes);
+        read(fd, padding, layout.payload - layout.header - frame.headerBytes);
+        read(fd, payload->GetData(), frame.payloadBytes);
+        read(fd, padding, layout.bytes - layout.payload - frame.payloadBytes);
+        total += static_cast<const byte*>(payload->GetData())[frame.payloadBytes - 1] != static_cast<byte>(0);
+      }
+      close(fd);
+    }
+    if (total != nframes) {
+      state.SkipWithError("frames missing");
+      break;
+    }
+  }
+  unlink(path.c_str());
+  state.SetItemsProcessed(state.iterations() * nframes);
+  state.SetBytesProcessed(state.iterations() * nframes * nbytes);
+  state.SetLabel(chunked ? "chunked" : "per frame");
+}
+BENCHMARK(BM_FrameStreamRead)->ArgsProduct({ { 256, 4096, 1 << 20 }, { 0, 1 } })->Unit(benchmark::kMillisecond);
+
+//__________________________________________________________________________________________________
+// validate a sealed (Stack, payload) pair with a payload of state.range(0) bytes: CRC32C with the crc32
+// instruction (range(1) == 0), with the table fallback (1), or only the header chain (2)
+static void BM_Validate(benchmark::State& state)
+{
+  const size_t nbytes = state.range(0);
+  const int mode = state.range(1);
+  Stack headers{ DataHeader{}, BaseHeader{} };
+  std::vector<byte> payload(nbytes, static_cast<byte>(7));
+  seal(headers.data(), headers.size(), payload.data(), payload.size());
+  for (auto _ : state) {
+    uint32_t crc = 0;
+    if (mode == 2) {
+      crc = static_cast<uint32_t>(validateHeaders(headers.data(), headers.size()));
+    }
+    else if (mode == 1) {
+      crc = internal::crc32cSoftware(0, payload.data(), payload.size());
+    }
+    else {
+      crc = static_cast<uint32_t>(validate(headers.data(), headers.size(), payload.data(), payload.size()));
+    }
+    benchmark::DoNotOptimize(crc);
+  }
+  state.SetBytesProcessed(state.iterations() * (mode == 2 ? headers.size() : nbytes));
+  const char* labels[] = { "crc32 instruction", "table", "headers only" };
+  state.SetLabel(labels[mode]);
+}
+BENCHMARK(BM_Validate)->ArgsProduct({ { 256, 4096, 1 << 16, 1 << 20, 1 << 26 }, { 0, 1 } });
+BENCHMARK(BM_Validate)->Args({ 0, 2 });
+
+//__________________________________________________________________________________________________
+// copy state.range(0) bytes to a buffer not touched since the last round: a plain memcpy (range(1) == 0) or the
+// BulkCopyEngine getMessage() falls back to (1)
+static void BM_BulkCopy(benchmark::State& state)
+{
+  const size_t nbytes = state.range(0);
+  const bool engine = state.range(1);
+  std::vector<byte> src(nbytes, static_cast<byte>(1));
+  std::vector<byte> dst(nbytes, static_cast<byte>(0));
+  for (auto _ : state) {
+    if (engine) {
+      bulkCopy(dst.data(), src.data(), nbytes);
+    }
+    else {
+      std::memcpy(dst.data(), src.data(), nbytes);
+    }
+    benchmark::DoNotOptimize(dst.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * nbytes);
+  state.counters["threads"] = engine ? BulkCopyEngine::instance().getOptions().threads : 1;
+  state.SetLabel(engine ? "engine" : "memcpy");
+}
+BENCHMARK(BM_BulkCopy)->ArgsProduct({ { 1 << 20, 16 << 20, 128 << 20 }, { 0, 1 } })->Unit(benchmark::kMicrosecond);
+
+// byte swap and widen 16 bit big endian samples to 32 bit while copying, state.range(0) samples: a loop doing the
+// swap and the conversion in two passes (range(1) == 0) or BulkCopyEngine::convert() in one (1)
+static void BM_BulkConvert(benchmark::State& state)
+{
+  const size_t n = state.range(0);
+  const bool engine = state.range(1);
+  std::vector<uint16_t> src(n, 0x1234);
+  std::vector<uint32_t> dst(n);
+  std::vector<uint16_t> swapped(engine ? 0 : n);
+  for (auto _ : state) {
+    if (engine) {
+      BulkCopyEngine::instance().convert(dst.data(), src.data(), n, ByteOrder::Swapped);
+    }
+    else {
+      for (size_t i = 0; i < n; ++i) {
+        swapped[i] = __builtin_bswap16(src[i]);
+      }
+      std::copy(swapped.begin(), swapped.end(), dst.begin());
+    }
+    benchmark::DoNotOptimize(dst.data());
+    benchmark::ClobberMemory();
+  }
+  state.SetBytesProcessed(state.iterations() * n * sizeof(uint32_t));
+  state.SetLabel(engine ? "engine" : "two passes");
+}
+BENCHMARK(BM_BulkConvert)->ArgsProduct({ { 1 << 20, 32 << 20 }, { 0, 1 } })->Unit(benchmark::kMicrosecond);
+
+//__________________________________________________________________________________________________
+// the hexDump of the previous versions: one printf and one fflush per byte, kept as reference
+static void perByteHexDump(FILE* out, const void* voidaddr, size_t len)
+{
+  auto addr = reinterpret_cast<const unsigned char*>(voidaddr);
+  char ascii[17] = {};
+  size_t i = 0;
+  for (; i < len; ++i) {
+    if (i % 16 == 0) {
+      if (i != 0) {
+        fprintf(out, "  %s\n", ascii);
+      }
+      fprintf(out, "  %p ", &addr[i]);
+    }
+    fprintf(out, " %02x", addr[i]);
+    ascii[i % 16] = (addr[i] < 0x20 || addr[i] > 0x7e) ? '.' : addr[i];
+    ascii[i % 16 + 1] = '\0';
+    fflush(out);
+  }
+  for (; i % 16 != 0; ++i) {
+    fprintf(out, "   ");
+  }
+  fprintf(out, "  %s\n", ascii);
+  fflush(out);
+}
+
+// dump state.range(0) bytes (no repeated lines) to /dev/null, per byte (range(1) == 0) or buffered (range(1) == 1)
+static void BM_HexDump(benchmark::State& state)
+{
+  const size_t nbytes = state.range(0);
+  const bool buffered = state.range(1);
+  std::vector<unsigned char> data(nbytes);
+  for (size_t i = 0; i < nbytes; ++i) {
+    data[i] = static_cast<unsigned char>(i * 7 + i / 256);
+  }
+  FILE* devnull = fopen("/dev/null", "w");
+  if (!devnull) {
+    state.SkipWithError("cannot open /dev/null");
+    return;
+  }
+  for (auto _ : state) {
+    if (buffered) {
+      hexDump(fileno(devnull), "bench", data.data(), nbytes);
+    }
+    else {
+      perByteHexDump(devnull, data.data(), nbytes);
+    }
+  }
+  fclose(devnull);
+  state.SetBytesProcessed(state.iterations() * nbytes);
+  state.SetLabel(buffered ? "buffered" : "per byte");
+}
+BENCHMARK(BM_HexDump)->ArgsProduct({ { 512, 1 << 16, 1 << 20 }, { 0, 1 } });
+
+//__________________________________________________________________________________________________
+// two processes sharing a ShmTransportFactory segment: the handles travel through a single producer single
+// consumer ring in an anonymous shared mapping, the child attaches to the segment through the inherited descriptor
+namespace {
+struct ShmHandleRing {
+  static constexpr size_t capacity() { return 1024; }
+  alignas(64) std::atomic<uint64_t> head{ 0 };
+  alignas(64) std::atomic<uint64_t> tail{ 0 };
+  uint64_t limit{ capacity() }; // handles in the ring at most, set before the fork
+  ShmHandle slots[1024];
+
+  void push(const ShmHandle& handle)
+  {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    while (t - head.load(std::memory_order_acquire) >= limit) {
+      std::this_thread::yield();
+    }
+    slots[t % capacity()] = handle;
+    tail.store(t + 1, std::memory_order_release);
+  }
+  ShmHandle pop()
+  {
+    uint64_t h = head.load(std::memory_order_relaxed);
+    while (tail.load(std::memory_order_acquire) == h) {
+      std::this_thread::yield();
+    }
+    ShmHandle handle = slots[h % capacity()];
+    head.store(h + 1, std::memory_order_release);
+    return handle;
+  }
+
+  static ShmHandleRing* create()
+  {
+    void* p = mmap(nullptr, sizeof(ShmHandleRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    return new (p) ShmHandleRing();
+  }
+  static void destroy(ShmHandleRing* ring) { munmap(ring, sizeof(ShmHandleRing)); }
+};
+}
+
+// throughput: the parent fills messages of state.range(0) bytes and sends them, the child adopts each one as a
+// vector, reads it and lets it go, which returns the buffer to the segment for the parent to reuse. The messages in
+// flight are bounded by what the segment holds: the ring, the one the child adopts and the one the parent fills.
+static void BM_ShmTwoProcessThroughput(benchmark::State& state)
+{
+  const size_t segmentBytes = size_t{ 256 } << 20;
+  ShmTransportFactory factory(segmentBytes);
+  const size_t nbytes = state.range(0);
+  size_t blockBytes = internal::shmSmallestBlock;
+  while (blockBytes < nbytes) {
+    blockBytes <<= 1;
+  }
+  const size_t blocks = (segmentBytes - 4096) / (blockBytes + 64); // less the segment header and block headers
+  if (blocks < 3) {
+    state.SkipWithError("messages too large for the segment");
+    return;
+  }
+  auto ring = ShmHandleRing::create();
+  ring->limit = std::min<uint64_t>(ShmHandleRing::capacity(), blocks - 2);
+  pid_t child = fork();
+  if (child == 0) {
+    auto attached = ShmTransportFactory::Attach(factory.GetSegmentFd());
+    ChannelResource resource(attached.get());
+    for (ShmHandle handle = ring->pop(); handle.segment; handle = ring->pop()) {
+      auto vector = adoptVector<char>(handle.size, &resource, attached->CreateMessage(handle));
+      benchmark::DoNotOptimize(vector.back());
+    }
+    _exit(0);
+  }
+  for (auto _ : state) {
+    auto message = factory.CreateMessage(nbytes);
+    std::memset(message->GetData(), 1, nbytes);
+    ring->push(factory.ReleaseMessage(std::move(message)));
+  }
+  ring->push(ShmHandle{});
+  waitpid(child, nullptr, 0);
+  ShmHandleRing::destroy(ring);
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * nbytes);
+}
+BENCHMARK(BM_ShmTwoProcessThroughput)->RangeMultiplier(64)->Range(64, 1 << 24)->UseRealTime();
+
+// latency: one message ping-pongs between the processes, round trip percentiles
+static void BM_ShmTwoProcessLatency(benchmark::State& state)
+{
+  using clock = std::chrono::steady_clock;
+  ShmTransportFactory factory(size_t{ 16 } << 20);
+  auto ping = ShmHandleRing::create();
+  auto pong = ShmHandleRing::create();
+  pid_t child = fork();
+  if (child == 0) {
+    auto attached = ShmTransportFactory::Attach(factory.GetSegmentFd());
+    for (ShmHandle handle = ping->pop(); handle.segment; handle = ping->pop()) {
+      auto message = attached->CreateMessage(handle);
+      static_cast<char*>(message->GetData())[0]++;
+      pong->push(attached->ReleaseMessage(std::move(message)));
+    }
+    _exit(0);
+  }
+  std::vector<int64_t> roundTrips;
+  roundTrips.reserve(1 << 20);
+  auto message = factory.CreateMessage(size_t{ 64 });
+  for (auto _ : state) {
+    auto start = clock::now();
+    ping->push(factory.ReleaseMessage(std::move(message)));
+    message = factory.CreateMessage(pong->pop());
+    if (roundTrips.size() < roundTrips.capacity()) {
+      roundTrips.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - start).count());
+    }
+  }
+  ping->push(ShmHandle{});
+  waitpid(child, nullptr, 0);
+  ShmHandleRing::destroy(ping);
+  ShmHandleRing::destroy(pong);
+
+  std::sort(roundTrips.begin(), roundTrips.end());
+  auto percentile = [&](double p) {
+    return roundTrips.empty() ? 0. : static_cast<double>(roundTrips[static_cast<size_t>(p * (roundTrips.size() - 1))]);
+  };
+  state.counters["rtt_p50_ns"] = percentile(0.5);
+  state.counters["rtt_p99_ns"] = percentile(0.99);
+  state.counters["rtt_p999_ns"] = percentile(0.999);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ShmTwoProcessLatency)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,271 @@
+#pragma once
+#include "fake.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+//__________________________________________________________________________________________________
+/// Tuning knobs of the BulkCopyEngine.
+struct BulkCopyOptions {
+  size_t threads{ 0 };                 // threads copying, the caller included, 0: one per hardware thread
+  size_t parallelBytes{ 8 << 20 };     // smaller copies stay on the calling thread
+  size_t chunkBytes{ 2 << 20 };        // unit of work of a thread
+  size_t nonTemporalBytes{ 32 << 20 }; // parallel copies this large bypass the caches, see BulkCopyEngine
+};
+
+/// Byte order of the source elements of BulkCopyEngine::convert()
+enum class ByteOrder {
+  Native,
+  Swapped // e.g. big endian data on a little endian host
+};
+
+namespace internal {
+//__________________________________________________________________________________________________
+template <size_t N>
+struct UnsignedOfSize;
+template <>
+struct UnsignedOfSize<1> {
+  using type = uint8_t;
+};
+template <>
+struct UnsignedOfSize<2> {
+  using type = uint16_t;
+};
+template <>
+struct UnsignedOfSize<4> {
+  using type = uint32_t;
+};
+template <>
+struct UnsignedOfSize<8> {
+  using type = uint64_t;
+};
+
+inline uint8_t byteSwap(uint8_t value) noexcept { return value; }
+inline uint16_t byteSwap(uint16_t value) noexcept { return __builtin_bswap16(value); }
+inline uint32_t byteSwap(uint32_t value) noexcept { return __builtin_bswap32(value); }
+inline uint64_t byteSwap(uint64_t value) noexcept { return __builtin_bswap64(value); }
+
+/// n elements from src to dst: byte swapped first if swap is set, then converted (widened) to DstT
+template <typename DstT, typename SrcT>
+void convertElements(DstT* dst, const SrcT* src, size_t n, bool swap) noexcept
+{
+  if (swap) {
+    using Raw = typename UnsignedOfSize<sizeof(SrcT)>::type;
+    for (size_t i = 0; i < n; ++i) {
+      Raw raw;
+      std::memcpy(&raw, src + i, sizeof(raw));
+      raw = byteSwap(raw);
+      SrcT value;
+      std::memcpy(&value, &raw, sizeof(value));
+      dst[i] = static_cast<DstT>(value);
+    }
+  }
+  else {
+    for (size_t i = 0; i < n; ++i) {
+      dst[i] = static_cast<DstT>(src[i]);
+    }
+  }
+}
+
+/// memcpy with streaming stores: the destination goes to memory without evicting the working set from the caches
+inline void copyNonTemporal(void* dst_, const void* src_, size_t bytes) noexcept
+{
+#ifdef __SSE2__
+  byte* dst = static_cast<byte*>(dst_);
+  const byte* src = static_cast<const byte*>(src_);
+  const size_t head = std::min(bytes, (16 - reinterpret_cast<uintptr_t>(dst) % 16) % 16);
+  std::memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  bytes -= head;
+  for (; bytes >= 64; bytes -= 64, dst += 64, src += 64) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+    __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32));
+    __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 48));
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dst), a);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 16), b);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 32), c);
+    _mm_stream_si128(reinterpret_cast<__m128i*>(dst + 48), d);
+  }
+  _mm_sfence(); // streaming stores are weakly ordered, publish them before the copy counts as done
+  std::memcpy(dst, src, bytes);
+#else
+  std::memcpy(dst_, src_, bytes);
+#endif
+}
+} // namespace internal
+
+//__________________________________________________________________________________________________
+/// Data movement for large buffers: getMessage() falls back to it when it has to copy a container to another
+/// transport, adoptVector() when it converts a message. Copies of parallelBytes and more are cut into chunks copied
+/// by a pool of threads (started on the first such copy) and the caller, anything else is a plain memcpy on the
+/// calling thread. The chunks of copies of nonTemporalBytes and more are written with streaming stores: memcpy
+/// streams large copies by itself, but not chunks of this size. One large copy runs on the pool at a time, a
+/// concurrent one is done by its caller alone rather than waiting.
+class BulkCopyEngine {
+public:
+  explicit BulkCopyEngine(BulkCopyOptions options = BulkCopyOptions{}) : mOptions{ options }
+  {
+    if (mOptions.threads == 0) {
+      mOptions.threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    mOptions.chunkBytes = std::max<size_t>(mOptions.chunkBytes, 4096);
+  }
+  BulkCopyEngine(const BulkCopyEngine&) = delete;
+  BulkCopyEngine& operator=(const BulkCopyEngine&) = delete;
+  ~BulkCopyEngine()
+  {
+    {
+      std::lock_guard<std::mutex> guard(mMutex);
+      mStop = true;
+    }
+    mWake.notify_all();
+    for (auto& worker : mWorkers) {
+      worker.join();
+    }
+  }
+
+  /// the engine used by getMessage() and adoptVector()
+  static BulkCopyEngine& instance()
+  {
+    static BulkCopyEngine engine;
+    return engine;
+  }
+
+  void copy(void* dst, const void* src, size_t bytes)
+  {
+    if (bytes < mOptions.parallelBytes || mOptions.threads < 2) {
+      std::memcpy(dst, src, bytes);
+      return;
+    }
+    const bool nonTemporal = bytes >= mOptions.nonTemporalBytes;
+    run(bytes, mOptions.chunkBytes, [=](size_t begin, size_t end) {
+      if (nonTemporal) {
+        internal::copyNonTemporal(static_cast<byte*>(dst) + begin, static_cast<const byte*>(src) + begin, end - begin);
+      }
+      else {
+        std::memcpy(static_cast<byte*>(dst) + begin, static_cast<const byte*>(src) + begin, end - begin);
+      }
+    });
+  }
+
+  /// copy n elements, byte swapped if order is Swapped, and widened if DstT is larger than SrcT
+  template <typename DstT, typename SrcT>
+  void convert(DstT* dst, const SrcT* src, size_t n, ByteOrder order = ByteOrder::Native)
+  {
+    static_assert(std::is_arithmetic<DstT>::value && std::is_arithmetic<SrcT>::value, "elements must be numbers");
+    static_assert(sizeof(DstT) >= sizeof(SrcT), "only widening conversions");
+    const bool swap = order == ByteOrder::Swapped && sizeof(SrcT) > 1;
+    if (!swap && std::is_same<DstT, SrcT>::value) {
+      copy(dst, src, n * sizeof(SrcT));
+      return;
+    }
+    if (n * sizeof(DstT) < mOptions.parallelBytes || mOptions.threads < 2) {
+      internal::convertElements(dst, src, n, swap);
+      return;
+    }
+    run(n, std::max<size_t>(1, mOptions.chunkBytes / sizeof(DstT)),
+        [=](size_t begin, size_t end) { internal::convertElements(dst + begin, src + begin, end - begin, swap); });
+  }
+
+  const BulkCopyOptions& getOptions() const noexcept { return mOptions; }
+
+private:
+  // one large copy, its chunks are taken by the pool and the caller
+  struct Job {
+    const std::function<void(size_t, size_t)>* work;
+    size_t total;
+    size_t chunk;
+    std::atomic<size_t> next{ 0 };
+  };
+
+  BulkCopyOptions mOptions;
+  std::mutex mRunning; // held by the caller of the large copy on the pool
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  std::condition_variable mIdle;
+  Job* mJob{ nullptr };      // the current job, nullptr once its caller is done with its share
+  uint64_t mGeneration{ 0 }; // of mJob, a worker takes a job only once
+  size_t mActive{ 0 };       // workers on a job
+  bool mStop{ false };
+  std::vector<std::thread> mWorkers;
+
+  // work(begin, end) on [0, total) in chunks
+  void run(size_t total, size_t chunk, const std::function<void(size_t, size_t)>& work)
+  {
+    std::unique_lock<std::mutex> running(mRunning, std::try_to_lock);
+    if (!running || mOptions.threads < 2 || total <= chunk) {
+      work(0, total);
+      return;
+    }
+    Job job{ &work, total, chunk };
+    {
+      std::lock_guard<std::mutex> guard(mMutex);
+      startWorkers();
+      mJob = &job;
+      ++mGeneration;
+    }
+    mWake.notify_all();
+    process(job);
+    // the job lives on this stack: retract it and wait for the workers still on it
+    std::unique_lock<std::mutex> lock(mMutex);
+    mJob = nullptr;
+    mIdle.wait(lock, [this] { return mActive == 0; });
+  }
+
+  static void process(Job& job)
+  {
+    for (;;) {
+      const size_t begin = job.next.fetch_add(1, std::memory_order_relaxed) * job.chunk;
+      if (begin >= job.total) {
+        return;
+      }
+      (*job.work)(begin, std::min(job.total, begin + job.chunk));
+    }
+  }
+
+  // with mMutex held
+  void startWorkers()
+  {
+    for (size_t i = mWorkers.size(); i + 1 < mOptions.threads; ++i) {
+      mWorkers.emplace_back([this] { serve(); });
+    }
+  }
+
+  void serve()
+  {
+    uint64_t seen = 0;
+    for (;;) {
+      Job* job;
+      {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mWake.wait(lock, [&] { return mStop || (mJob && mGeneration != seen); });
+        if (mStop) {
+          return;
+        }
+        seen = mGeneration;
+        job = mJob;
+        ++mActive;
+      }
+      process(*job);
+      {
+        std::lock_guard<std::mutex> guard(mMutex);
+        --mActive;
+      }
+      mIdle.notify_one();
+    }
+  }
+};
+
+//__________________________________________________________________________________________________
+/// copy bytes with the BulkCopyEngine::instance()
+inline void bulkCopy(void* dst, const void* src, size_t bytes) { BulkCopyEngine::instance().copy(dst, src, bytes); }
@@ -0,0 +1,344 @@
+#include "framestream.h"
+#include "messagequeue.h"
+#include "test.h"
+#include "validation.h"
+#include <unistd.h>
+#include <atomic>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Behaviour checks of the parts that the demo (test.cxx) and the benchmarks (bench.cxx) only exercise: "make check"
+// runs them and fails on the first broken section.
+
+static std::atomic<int> failures{ 0 };
+
+#define CHECK(condition)                                                                                       \
+  do {                                                                                                         \
+    if (!(condition)) {                                                                                        \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);                            \
+      ++failures;                                                                                              \
+    }                                                                                                          \
+  } while (0)
+
+//__________________________________________________________________________________________________
+// tags of the queued messages: producer in the high, sequence number in the low 32 bits
+static FairMQMessagePtr taggedMessage(FairMQTransportFactory& factory, uint64_t tag)
+{
+  auto message = factory.CreateMessage(sizeof(tag));
+  std::memcpy(message->GetData(), &tag, sizeof(tag));
+  return message;
+}
+
+static uint64_t tagOf(const FairMQMessagePtr& message)
+{
+  uint64_t tag = 0;
+  std::memcpy(&tag, message->GetData(), sizeof(tag));
+  return tag;
+}
+
+// producers push perProducer tagged messages each (in batches of batch), consumers pop until all arrived. Every tag
+// has to arrive exactly once, and every consumer sees the messages of a producer in the order they were pushed.
+template <typename QueueT>
+static void checkQueue(const char* name, size_t producers, size_t consumers, size_t batch)
+{
+  const size_t perProducer = 20000;
+  const size_t total = producers * perProducer;
+  FairMQTransportFactory factory;
+  QueueT queue(16); // small, so the queue wraps around and runs full and empty all the time
+  std::atomic<size_t> popped{ 0 };
+  std::vector<std::vector<uint64_t>> received(consumers);
+
+  std::vector<std::thread> threads;
+  for (size_t p = 0; p < producers; ++p) {
+    threads.emplace_back([&, p] {
+      std::vector<FairMQMessagePtr> messages(batch);
+      for (size_t i = 0; i < perProducer; i += batch) {
+        size_t n = std::min(batch, perProducer - i);
+        for (size_t j = 0; j < n; ++j) {
+          messages[j] = taggedMessage(factory, p << 32 | (i + j));
+        }
+        queue.push(messages.data(), n);
+      }
+    });
+  }
+  for (size_t c = 0; c < consumers; ++c) {
+    threads.emplace_back([&, c] {
+      FairMQMessagePtr messages[7];
+      while (popped.load(std::memory_order_relaxed) < total) {
+        size_t n = queue.tryPop(messages, 7);
+        for (size_t j = 0; j < n; ++j) {
+          received[c].push_back(tagOf(messages[j]));
+        }
+        popped += n;
+        if (n == 0) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  std::vector<size_t> seen(total, 0);
+  bool ordered = true;
+  for (auto& tags : received) {
+    std::vector<int64_t> last(producers, -1);
+    for (uint64_t tag : tags) {
+      size_t producer = tag >> 32;
+      int64_t sequence = tag & 0xffffffff;
+      if (producer >= producers || sequence >= static_cast<int64_t>(perProducer)) {
+        CHECK(!"tag out of range");
+        continue;
+      }
+      ordered = ordered && sequence > last[producer];
+      last[producer] = sequence;
+      ++seen[producer * perProducer + sequence];
+    }
+  }
+  size_t once = 0;
+  for (size_t count : seen) {
+    once += count == 1;
+  }
+  CHECK(once == total);
+  CHECK(ordered);
+  CHECK(queue.empty());
+  printf("%s %zu producers %zu consumers, batches of %zu: %zu of %zu tags exactly once%s\n", name, producers,
+         consumers, batch, once, total, ordered ? ", in order" : ", OUT OF ORDER");
+}
+
+static void checkQueues()
+{
+  checkQueue<SPSCMessageQueue>("SPSCQueue", 1, 1, 1);
+  checkQueue<SPSCMessageQueue>("SPSCQueue", 1, 1, 5);
+  checkQueue<MPMCMessageQueue>("MPMCQueue", 4, 3, 1);
+  checkQueue<MPMCMessageQueue>("MPMCQueue", 3, 4, 5);
+
+  // the helpers on top: parts keep their order, a container comes out as a view of the same buffer
+  FairMQTransportFactory factory;
+  MPMCMessageQueue queue(8);
+  FairMQParts parts;
+  for (uint64_t i = 0; i < 5; ++i) {
+    parts.AddPart(taggedMessage(factory, i));
+  }
+  pushParts(queue, parts);
+  CHECK(parts.Size() == 0 && queue.size() == 5);
+  FairMQParts back;
+  popParts(queue, back, 5);
+  CHECK(back.Size() == 5 && queue.empty());
+  for (uint64_t i = 0; i < back.fParts.size(); ++i) {
+    CHECK(tagOf(back.fParts[i]) == i);
+  }
+
+  ChannelResource resource(&factory);
+  std::vector<uint32_t, SpectatorAllocator<uint32_t>> vector(SpectatorAllocator<uint32_t>{ &resource });
+  vector.reserve(4);
+  vector.push_back(7);
+  vector.push_back(9);
+  const uint32_t* data = vector.data();
+  pushContainer(queue, std::move(vector));
+  auto view = popView<uint32_t>(queue);
+  CHECK(view.size() == 2 && view[0] == 7 && view[1] == 9 && view.data() == data);
+}
+
+//__________________________________________________________________________________________________
+// frame i of the stream: a header and a payload part of varied sizes (zero included, and payloads large enough to be
+// written directly and to exceed the reader's chunk), with contents depending on frame, part and position
+static size_t frameHeaderBytes(size_t i)
+{
+  static const size_t sizes[] = { 0, 8, 40, 56, 96, 1000, 5000 };
+  return sizes[i % 7];
+}
+static size_t framePayloadBytes(size_t i)
+{
+  static const size_t sizes[] = { 0, 1, 64, 700, 20000, 100001 }; // 6 against 7: every combination comes up
+  return sizes[i % 6];
+}
+static byte frameByte(size_t i, size_t part, size_t b) { return static_cast<byte>(i * 31 + part * 7 + b * 13); }
+
+static std::vector<byte> frameBytes(size_t i, size_t part)
+{
+  std::vector<byte> bytes(part ? framePayloadBytes(i) : frameHeaderBytes(i));
+  for (size_t b = 0; b < bytes.size(); ++b) {
+    bytes[b] = frameByte(i, part, b);
+  }
+  return bytes;
+}
+
+static bool sameBytes(const FairMQMessagePtr& message, size_t i, size_t part)
+{
+  auto expected = frameBytes(i, part);
+  return message && message->GetSize() == expected.size() &&
+         (expected.empty() || std::memcmp(message->GetData(), expected.data(), expected.size()) == 0);
+}
+
+static bool sameFrame(const Frame& frame, size_t i)
+{
+  return sameBytes(frame.header, i, 0) && sameBytes(frame.payload, i, 1);
+}
+
+static void checkFrameStream()
+{
+  char path[] = "/tmp/fakemq-check-XXXXXX";
+  int fd = mkstemp(path);
+  CHECK(fd >= 0);
+  close(fd);
+  const size_t nFrames = 200;
+  {
+    FrameWriter writer(path, FrameWriterOptions{ 64, 8192, 16384 });
+    for (size_t i = 0; i < nFrames; ++i) {
+      auto header = frameBytes(i, 0);
+      auto payload = frameBytes(i, 1);
+      writer.Write(header.data(), header.size(), payload.data(), payload.size());
+    }
+  }
+
+  // in order, through a chunk smaller than the largest frames
+  FrameReaderOptions options{ 16384, 2 };
+  std::vector<FrameIndexEntry> index;
+  {
+    FrameReader reader(path, options);
+    index = reader.ReadIndex();
+    CHECK(index.size() == nFrames);
+    Frame frame;
+    size_t i = 0;
+    bool exact = true;
+    for (; reader.Read(frame); ++i) {
+      exact = exact && i < index.size() && sameFrame(frame, i) && frame.offset == index[i].offset &&
+              index[i].headerBytes == frameHeaderBytes(i) && index[i].payloadBytes == framePayloadBytes(i) &&
+              reinterpret_cast<uintptr_t>(frame.payload->GetData()) % 64 == 0;
+    }
+    CHECK(i == nFrames);
+    CHECK(exact);
+
+    // random access through the index, backwards and forwards, then reading on from there
+    bool seeks = true;
+    for (size_t k : { 150, 3, 77, 0, 199, 42 }) {
+      reader.Seek(index[k].offset);
+      Frame at;
+      Frame next;
+      seeks = seeks && reader.Read(at) && sameFrame(at, k) && at.offset == index[k].offset;
+      seeks = seeks && (k + 1 == nFrames ? !reader.Read(next) : reader.Read(next) && sameFrame(next, k + 1));
+    }
+    CHECK(seeks);
+  }
+
+  // truncated: the frames before the cut read back exact, the cut frame and the index are rejected
+  const uint64_t cut = index[120].offset + 20;
+  CHECK(truncate(path, cut) == 0);
+  {
+    FrameReader reader(path, options);
+    Frame frame;
+    size_t i = 0;
+    bool exact = true;
+    for (; reader.Read(frame); ++i) {
+      exact = exact && sameFrame(frame, i);
+    }
+    CHECK(i == 120);
+    CHECK(exact);
+    bool rejected = false;
+    try {
+      reader.ReadIndex();
+    }
+    catch (std::runtime_error&) {
+      rejected = true;
+    }
+    CHECK(rejected);
+  }
+  unlink(path);
+  printf("FrameWriter/FrameReader: %zu frames round trip, seek and truncation checked\n", nFrames);
+}
+
+//__________________________________________________________________________________________________
+// bit by bit, the definition the table driven and the hardware CRCs have to agree with
+static uint32_t crc32cReference(uint32_t crc, const byte* data, size_t len)
+{
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i) {
+    crc ^= static_cast<uint8_t>(data[i]);
+    for (int bit = 0; bit < 8; ++bit) {
+      crc = crc & 1 ? (crc >> 1) ^ internal::crc32cPolynomial : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+// the header stack of len bytes at headers, copied to an aligned buffer and changed by mutate
+template <typename MutateT>
+static ValidationStatus validateMutated(const byte* headers, size_t len, MutateT mutate)
+{
+  std::vector<uint64_t> copy((len + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+  byte* buffer = reinterpret_cast<byte*>(copy.data());
+  std::memcpy(buffer, headers, len);
+  mutate(reinterpret_cast<BaseHeader*>(buffer));
+  return validateHeaders(buffer, len);
+}
+
+static void checkValidation()
+{
+  CHECK(crc32c(0, "123456789", 9) == 0xe3069283);
+
+  // lengths around the blocks of the interleaved hardware loop, from unaligned starts, and split in two calls
+  std::vector<byte> data(50000 + 8);
+  for (size_t i = 0; i < data.size(); ++i) {
+    data[i] = static_cast<byte>(i * 2654435761u >> 24);
+  }
+  const char* paths = "software";
+#if defined(__x86_64__)
+  const bool hardware = internal::haveCrc32cInstruction();
+  if (hardware) {
+    paths = "hardware and software";
+  }
+#endif
+  bool agree = true;
+  for (size_t len : { 0, 1, 7, 8, 9, 255, 768, 769, 3000, 24575, 24576, 24577, 50000 }) {
+    for (size_t offset : { 0, 1, 3, 8 }) {
+      const byte* start = data.data() + offset;
+      const uint32_t expected = crc32cReference(0, start, len);
+      agree = agree && internal::crc32cSoftware(0, start, len) == expected && crc32c(0, start, len) == expected;
+      agree = agree && crc32c(crc32c(0, start, len / 3), start + len / 3, len - len / 3) == expected;
+#if defined(__x86_64__)
+      agree = agree && (!hardware || internal::crc32cHardware(0, start, len) == expected);
+#endif
+    }
+  }
+  CHECK(agree);
+
+  Stack stack{ DataHeader{}, BaseHeader{} };
+  const byte* headers = stack.data();
+  const size_t len = stack.size();
+  CHECK(validateHeaders(headers, len) == ValidationStatus::Ok);
+  CHECK(validateMutated(headers, len, [](BaseHeader* first) { first->magic[1] = 'X'; }) == ValidationStatus::BadMagic);
+  CHECK(validateMutated(headers, len, [len](BaseHeader* first) {
+          first->headerSize = static_cast<uint32_t>(len + alignof(BaseHeader));
+        }) == ValidationStatus::Truncated);
+  CHECK(validateMutated(headers, len, [](BaseHeader* first) {
+          BaseHeader* last = reinterpret_cast<BaseHeader*>(reinterpret_cast<byte*>(first) + first->headerSize);
+          last->flagsNextHeader = 1;
+        }) == ValidationStatus::Truncated);
+
+  // a sealed stack validates until a byte of the payload changes
+  std::vector<byte> payload(data.begin(), data.begin() + 1000);
+  CHECK(seal(stack.data(), len, payload.data(), payload.size()) == ValidationStatus::Ok);
+  CHECK(validate(headers, len, payload.data(), payload.size()) == ValidationStatus::Ok);
+  payload[500] = static_cast<byte>(~static_cast<uint8_t>(payload[500]));
+  CHECK(validate(headers, len, payload.data(), payload.size()) == ValidationStatus::BadChecksum);
+  printf("crc32c: known answer and %s paths checked, validateHeaders rejects bad magic and overruns\n", paths);
+}
+
+//__________________________________________________________________________________________________
+int main()
+{
+  checkQueues();
+  checkFrameStream();
+  checkValidation();
+  if (failures) {
+    printf("%i checks failed\n", failures.load());
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
@@ -1,15 +1,67 @@
-
+#pragma once
 #include "memory"
 #include <boost/container/pmr/global_resource.hpp>
 #include <boost/container/pmr/polymorphic_allocator.hpp>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <type_traits>
 #include <utility>
 #include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 enum class byte : unsigned char {};
 
+// Tracing of message, element and header lifetimes. It is a compile time policy: on by default in debug builds,
+// expands to nothing if NDEBUG is defined. FAKEMQ_ENABLE_TRACE=0/1 overrides either way.
+#ifndef FAKEMQ_ENABLE_TRACE
+#ifdef NDEBUG
+#define FAKEMQ_ENABLE_TRACE 0
+#else
+#define FAKEMQ_ENABLE_TRACE 1
+#endif
+#endif
+
+#if FAKEMQ_ENABLE_TRACE
+#define FAKEMQ_TRACE(...) printf(__VA_ARGS__)
+#else
+#define FAKEMQ_TRACE(...) ((void)0)
+#endif
+
+// Instrumentation of the memory resources (counters and histograms, see ResourceStatsSnapshot). Off unless
+// FAKEMQ_ENABLE_STATS=1, the hooks expand to nothing then.
+#ifndef FAKEMQ_ENABLE_STATS
+#define FAKEMQ_ENABLE_STATS 0
+#endif
+
+#if FAKEMQ_ENABLE_STATS
+#define FAKEMQ_STATS(...) __VA_ARGS__
+#else
+#define FAKEMQ_STATS(...) ((void)0)
+#endif
+
+// Debug aid: define FAKEMQ_POISON_ON_FREE to overwrite heap message buffers with FAKEMQ_POISON_BYTE before they are
+// released, so a use after free shows up as a recognizable pattern. Off by default, it touches every freed byte.
+#ifndef FAKEMQ_POISON_BYTE
+#define FAKEMQ_POISON_BYTE 0xdd
+#endif
+
+// Header stacks up to FAKEMQ_STACK_INLINE_BYTES live inside the Stack object instead of a buffer of its allocator,
+// a DataHeader plus a few small headers by default. 0 puts every stack into an allocated buffer.
+#ifndef FAKEMQ_STACK_INLINE_BYTES
+#define FAKEMQ_STACK_INLINE_BYTES 128
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // FakeMQ
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -25,31 +77,35 @@ class FairMQMessage {
   size_t usedBytes{ 0 };
 
 public:
-  FairMQMessage(size_t size) : bytes{ size }, data{ new byte[size] }
+  FairMQMessage(size_t size) : bytes{ size }, data{ new byte[size] }, usedBytes{ size }
   {
-    printf("ctor FairMQMessage(%li bytes) at %p, data: %p\n", bytes, this, data);
+    FAKEMQ_TRACE("ctor FairMQMessage(%li bytes) at %p, data: %p\n", bytes, this, data);
   }
 
   FairMQMessage(void* data_, size_t size, fairmq_free_fn* ffn = nullptr, void* hint_ = nullptr)
-    : freefn{ ffn }, hint{ hint_ }, bytes{ size }, data{ static_cast<byte*>(data_) }
+    : freefn{ ffn }, hint{ hint_ }, bytes{ size }, data{ static_cast<byte*>(data_) }, usedBytes{ size }
   {
-    printf("ctor FairMQMessage(%li bytes) at %p, data: %p\n", bytes, this, data);
+    FAKEMQ_TRACE("ctor FairMQMessage(%li bytes) at %p, data: %p\n", bytes, this, data);
   }
 
   ~FairMQMessage()
   {
     if (freefn) {
-      printf("ffn FairMQMessage() %li bytes at: %p, data: %p, freefn: %p, hint: %p\n", bytes, this, data, freefn, hint);
+      FAKEMQ_TRACE("ffn FairMQMessage() %li bytes at: %p, data: %p, freefn: %p, hint: %p\n", bytes, this, data, freefn, hint);
       freefn(data, hint);
     }
     else {
-      printf("dtor FairMQMessage() %li bytes at: %p, data: %p\n", bytes, this, data);
-      std::memset(data, 0, bytes);
+      FAKEMQ_TRACE("dtor FairMQMessage() %li bytes at: %p, data: %p\n", bytes, this, data);
+#ifdef FAKEMQ_POISON_ON_FREE
+      std::memset(data, FAKEMQ_POISON_BYTE, bytes);
+#endif
       delete[] data;
     }
   }
 
   size_t GetSize() const { return bytes; }
+  /// the size the receiving side sees, by default the whole buffer
+  size_t GetUsedSize() const { return usedBytes; }
   void* GetData() const { return data; }
   bool SetUsedSize(const size_t size)
   {
@@ -64,14 +120,208 @@ public:
 
 using FairMQMessagePtr = std::unique_ptr<FairMQMessage>;
 
+//__________________________________________________________________________________________________
+/// How the buffers of new messages are backed.
+enum class MessageBacking {
+  Heap,                 // new byte[]
+  Mmap,                 // anonymous mapping, 4 KiB pages
+  TransparentHugePages, // 2 MiB aligned anonymous mapping with madvise(MADV_HUGEPAGE)
+  ExplicitHugePages     // MAP_HUGETLB from the reserved huge page pool, THP if none are configured
+};
+
+//__________________________________________________________________________________________________
+/// Backing and placement of message buffers. NUMA placement only applies to mapped buffers and is a preference,
+/// a full or missing node falls back to the default policy.
+struct MemoryPolicy {
+  MessageBacking backing{ MessageBacking::Heap };
+  int numaNode{ -1 };              // prefer this node, -1: no preference
+  bool nearCallingThread{ false }; // prefer the node of the CPU the allocating thread runs on
+};
+
+namespace internal {
+//__________________________________________________________________________________________________
+/// free function of mapped buffers, the hint is the length of the mapping
+inline void unmapBuffer(void* data, void* hint) { munmap(data, reinterpret_cast<uintptr_t>(hint)); }
+
+inline int currentNumaNode() noexcept
+{
+#if defined(__linux__) && defined(SYS_getcpu)
+  unsigned cpu = 0, node = 0;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+    return node;
+  }
+#endif
+  return -1;
+}
+
+//__________________________________________________________________________________________________
+/// map a buffer of at least size bytes according to the policy, degrading to smaller pages if huge pages are not
+/// available. Returns nullptr if nothing could be mapped, the length of the mapping is returned in length.
+inline void* mapBuffer(size_t size, const MemoryPolicy& policy, size_t& length) noexcept
+{
+  constexpr size_t hugePageSize = size_t{ 2 } << 20;
+  const size_t pageSize = sysconf(_SC_PAGESIZE);
+  void* addr = MAP_FAILED;
+  length = (std::max(size, size_t{ 1 }) + pageSize - 1) / pageSize * pageSize;
+
+#ifdef MAP_HUGETLB
+  if (policy.backing == MessageBacking::ExplicitHugePages) {
+    size_t hugeLength = (length + hugePageSize - 1) / hugePageSize * hugePageSize;
+    addr = mmap(nullptr, hugeLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+      length = hugeLength;
+    }
+  }
+#endif
+  if (addr == MAP_FAILED && policy.backing != MessageBacking::Mmap) {
+    // over-allocate to get a huge page aligned range, then trim both ends
+    size_t hugeLength = (length + hugePageSize - 1) / hugePageSize * hugePageSize;
+    void* raw = mmap(nullptr, hugeLength + hugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw != MAP_FAILED) {
+      uintptr_t begin = reinterpret_cast<uintptr_t>(raw);
+      uintptr_t aligned = (begin + hugePageSize - 1) / hugePageSize * hugePageSize;
+      if (aligned > begin) {
+        munmap(raw, aligned - begin);
+      }
+      munmap(reinterpret_cast<void*>(aligned + hugeLength), begin + hugePageSize - aligned);
+      addr = reinterpret_cast<void*>(aligned);
+      length = hugeLength;
+#ifdef MADV_HUGEPAGE
+      madvise(addr, length, MADV_HUGEPAGE); // a no-op if THP is disabled
+#endif
+    }
+  }
+  if (addr == MAP_FAILED) {
+    addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      return nullptr;
+    }
+  }
+
+#if defined(__linux__) && defined(SYS_mbind)
+  // placement has to be set before the first touch
+  int node = policy.numaNode >= 0 ? policy.numaNode : policy.nearCallingThread ? currentNumaNode() : -1;
+  if (node >= 0 && node < 64) {
+    constexpr int mpolPreferred = 1; // MPOL_PREFERRED, not pulling in numaif.h for it
+    unsigned long nodeMask = 1UL << node;
+    syscall(SYS_mbind, addr, length, mpolPreferred, &nodeMask, sizeof(nodeMask) * 8, 0); // best effort
+  }
+#endif
+  return addr;
+}
+
+//__________________________________________________________________________________________________
+/// One buffer shared by several messages (see FairMQTransportFactory::CreateMessages()), freed with the last of them.
+struct SharedRegion {
+  std::atomic<size_t> refs;
+  void* data;
+  size_t mapped; // length of the mapping, 0 for heap memory
+};
+
+/// free function of the messages carved from a SharedRegion, the hint is the region
+inline void releaseRegion(void* /*data*/, void* hint)
+{
+  auto region = static_cast<SharedRegion*>(hint);
+  if (region->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    if (region->mapped) {
+      munmap(region->data, region->mapped);
+    }
+    else {
+      delete[] static_cast<byte*>(region->data);
+    }
+    delete region;
+  }
+}
+}
+
 //__________________________________________________________________________________________________
 class FairMQTransportFactory {
 public:
+  FairMQTransportFactory() = default;
+  FairMQTransportFactory(MemoryPolicy policy) : memoryPolicy{ policy } {}
+  virtual ~FairMQTransportFactory() = default;
+
+  /// the policy applied by CreateMessage(size)
+  const MemoryPolicy& GetMemoryPolicy() const noexcept { return memoryPolicy; }
+
+  /// can messages of this transport point to memory allocated by the origin transport (nullptr: origin unknown,
+  /// plain process memory)? If not, data coming from there has to be copied. Heap messages can adopt anything.
+  virtual bool CanAdopt(const FairMQTransportFactory* /*origin*/) const noexcept { return true; }
+
   FairMQMessagePtr CreateMessage(void* data, size_t size, fairmq_free_fn* ffn, void* hint = nullptr) const
   {
     return std::make_unique<FairMQMessage>(data, size, ffn, hint);
   };
-  FairMQMessagePtr CreateMessage(const size_t size) const { return std::make_unique<FairMQMessage>(size); };
+  /// the allocating calls are virtual so other transports (e.g. ShmTransportFactory) can place the buffers
+  FairMQMessagePtr CreateMessage(const size_t size) const { return CreateMessage(size, memoryPolicy); };
+  virtual FairMQMessagePtr CreateMessage(const size_t size, const MemoryPolicy& policy) const
+  {
+    if (policy.backing != MessageBacking::Heap) {
+      size_t length = 0;
+      if (void* addr = internal::mapBuffer(size, policy, length)) {
+        return std::make_unique<FairMQMessage>(addr, size, &internal::unmapBuffer,
+                                               reinterpret_cast<void*>(static_cast<uintptr_t>(length)));
+      }
+    }
+    return std::make_unique<FairMQMessage>(size);
+  };
+
+  /// create n messages of the given sizes carved from one buffer: one allocation instead of n, each part aligned to
+  /// alignment (a power of two). The buffer is freed with the last of the messages, so a long lived part keeps
+  /// the whole region alive.
+  std::vector<FairMQMessagePtr> CreateMessages(const size_t* sizes, size_t n,
+                                               size_t alignment = alignof(std::max_align_t)) const
+  {
+    return CreateMessages(sizes, n, memoryPolicy, alignment);
+  }
+  virtual std::vector<FairMQMessagePtr> CreateMessages(const size_t* sizes, size_t n, const MemoryPolicy& policy,
+                                                       size_t alignment = alignof(std::max_align_t)) const
+  {
+    std::vector<FairMQMessagePtr> messages;
+    if (n == 0) {
+      return messages;
+    }
+    alignment = std::max(alignment, alignof(std::max_align_t));
+    // every part gets at least one slot so no two parts share an address
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+      total += (std::max(sizes[i], size_t{ 1 }) + alignment - 1) & ~(alignment - 1);
+    }
+
+    messages.reserve(n);
+    std::unique_ptr<internal::SharedRegion> region{ new internal::SharedRegion{ { 1 }, nullptr, 0 } };
+    void* data = nullptr;
+    size_t mapped = 0;
+    byte* begin = nullptr;
+    if (policy.backing != MessageBacking::Heap) {
+      data = internal::mapBuffer(total, policy, mapped);
+      begin = static_cast<byte*>(data); // page aligned
+    }
+    if (!data) {
+      mapped = 0;
+      data = new byte[alignment > alignof(std::max_align_t) ? total + alignment : total];
+      uintptr_t raw = reinterpret_cast<uintptr_t>(data);
+      begin = reinterpret_cast<byte*>((raw + alignment - 1) & ~(alignment - 1));
+    }
+
+    // the reference held here keeps the region alive (or frees it) should creating one of the messages throw
+    struct Guard {
+      internal::SharedRegion* region;
+      ~Guard() { internal::releaseRegion(nullptr, region); }
+    } guard{ region.release() };
+    guard.region->data = data;
+    guard.region->mapped = mapped;
+    for (size_t i = 0; i < n; ++i) {
+      auto message = std::make_unique<FairMQMessage>(begin, sizes[i], &internal::releaseRegion, guard.region);
+      guard.region->refs.fetch_add(1, std::memory_order_relaxed);
+      messages.push_back(std::move(message));
+      begin += (std::max(sizes[i], size_t{ 1 }) + alignment - 1) & ~(alignment - 1);
+    }
+    return messages;
+  }
+
+private:
+  MemoryPolicy memoryPolicy{};
 };
 
 //__________________________________________________________________________________________________
@@ -85,21 +335,21 @@ struct uninitializedValue {
 struct elem {
   int content;
   // int more;
-  elem() noexcept : content{ 0 } { printf("default ctor elem: %i @%p\n", content, this); }
-  elem(int i) noexcept : content{ i } { printf("ctor elem %i @%p\n", i, this); }
-  ~elem() { printf("dtor elem %i @%p\n", content, this); }
-  elem(const elem& in) noexcept : content{ in.content } { printf("copy ctor elem %i %p -> %p\n", content, &in, this); }
-  elem(const elem&& in) noexcept : content{ in.content } { printf("move ctor elem %i %p -> %p\n", content, &in, this); }
+  elem() noexcept : content{ 0 } { FAKEMQ_TRACE("default ctor elem: %i @%p\n", content, this); }
+  elem(int i) noexcept : content{ i } { FAKEMQ_TRACE("ctor elem %i @%p\n", i, this); }
+  ~elem() { FAKEMQ_TRACE("dtor elem %i @%p\n", content, this); }
+  elem(const elem& in) noexcept : content{ in.content } { FAKEMQ_TRACE("copy ctor elem %i %p -> %p\n", content, &in, this); }
+  elem(const elem&& in) noexcept : content{ in.content } { FAKEMQ_TRACE("move ctor elem %i %p -> %p\n", content, &in, this); }
   elem& operator=(elem& in) noexcept
   {
     content = in.content;
-    printf("copy assign elem %i %p = %p\n", content, this, &in);
+    FAKEMQ_TRACE("copy assign elem %i %p = %p\n", content, this, &in);
     return *this;
   }
   elem& operator=(elem&& in) noexcept
   {
     content = in.content;
-    printf("move assign elem %i %p = %p\n", content, this, &in);
+    FAKEMQ_TRACE("move assign elem %i %p = %p\n", content, this, &in);
     return *this;
   }
 };
@@ -120,6 +370,8 @@ public:
   FairMQParts(FairMQParts&& p) = default;
   /// Assignment operator
   FairMQParts& operator=(const FairMQParts&) = delete;
+  /// Move assignment operator
+  FairMQParts& operator=(FairMQParts&& p) = default;
   /// Default destructor
   ~FairMQParts(){};
 
@@ -166,6 +418,32 @@ public:
   auto cend() -> decltype(fParts.cend()) { return fParts.cend(); }
 };
 
+//__________________________________________________________________________________________________
+/// Identifies the type of a header in a stack: up to 8 characters packed into an integer, so comparing is cheap.
+struct HeaderType {
+  uint64_t itg{ 0 };
+
+  constexpr HeaderType() noexcept = default;
+  template <size_t N>
+  constexpr HeaderType(const char (&s)[N]) noexcept : itg{ pack(s, N - 1) }
+  {
+    static_assert(N <= 9, "a header type is at most 8 characters");
+  }
+  constexpr bool operator==(const HeaderType other) const noexcept { return itg == other.itg; }
+  constexpr bool operator!=(const HeaderType other) const noexcept { return itg != other.itg; }
+
+ private:
+  static constexpr uint64_t pack(const char* s, size_t n) noexcept
+  {
+    uint64_t value = 0;
+    for (size_t i = 0; i < n; ++i) {
+      value |= static_cast<uint64_t>(static_cast<unsigned char>(s[i])) << (8 * i);
+    }
+    return value;
+  }
+};
+
+//__________________________________________________________________________________________________
 struct BaseHeader {
   char magic[4]{ 'O', '2', 'O', '2' };
   uint64_t alignment{ 0 };
@@ -177,49 +455,86 @@ struct BaseHeader {
   };
 
   uint32_t headerSize{ sizeof(BaseHeader) };
+  /// type of the (derived) header, see get<HeaderT>()
+  HeaderType description{ "BaseHead" };
+
+  static constexpr HeaderType headerType() noexcept { return HeaderType{ "BaseHead" }; }
 
   constexpr uint32_t size() const noexcept { return headerSize; }
   const byte* data() const noexcept { return reinterpret_cast<const byte*>(this); }
   constexpr BaseHeader() noexcept : flagsNextHeader{ 0 }, flagsUnused{0}
   {
-    printf("default ctor BaseHeader: %i @%p, size: %u\n", flagsNextHeader, this, headerSize);
+    FAKEMQ_TRACE("default ctor BaseHeader: %i @%p, size: %u\n", flagsNextHeader, this, headerSize);
   }
   constexpr BaseHeader(uint32_t size) noexcept : flagsNextHeader{ 0 }, flagsUnused{0}, headerSize{ size }
   {
-    printf("default ctor BaseHeader: %i @%p, size: %u\n", flagsNextHeader, this, size);
+    FAKEMQ_TRACE("default ctor BaseHeader: %i @%p, size: %u\n", flagsNextHeader, this, size);
+  }
+  constexpr BaseHeader(uint32_t size, HeaderType type) noexcept
+    : flagsNextHeader{ 0 }, flagsUnused{ 0 }, headerSize{ size }, description{ type }
+  {
+    FAKEMQ_TRACE("default ctor BaseHeader: %i @%p, size: %u\n", flagsNextHeader, this, size);
   }
   //~BaseHeader() { printf("dtor BaseHeader %i @%p\n", flagsNextHeader, this); }
-  BaseHeader(const BaseHeader& in) noexcept : flagsNextHeader{ in.flagsNextHeader }
+  // copies keep size and type, or get<HeaderT>() would not find a copied derived header
+  BaseHeader(const BaseHeader& in) noexcept
+    : flagsNextHeader{ in.flagsNextHeader }, flagsUnused{ in.flagsUnused }, headerSize{ in.headerSize },
+      description{ in.description }
   {
-    printf("copy ctor BaseHeader %i %p -> %p\n", flagsNextHeader, &in, this);
+    FAKEMQ_TRACE("copy ctor BaseHeader %i %p -> %p\n", flagsNextHeader, &in, this);
   }
-  BaseHeader(const BaseHeader&& in) noexcept : flagsNextHeader{ in.flagsNextHeader }
+  BaseHeader(const BaseHeader&& in) noexcept
+    : flagsNextHeader{ in.flagsNextHeader }, flagsUnused{ in.flagsUnused }, headerSize{ in.headerSize },
+      description{ in.description }
   {
-    printf("move ctor BaseHeader %i %p -> %p\n", flagsNextHeader, &in, this);
+    FAKEMQ_TRACE("move ctor BaseHeader %i %p -> %p\n", flagsNextHeader, &in, this);
   }
   BaseHeader& operator=(BaseHeader& in) noexcept
   {
     flagsNextHeader = in.flagsNextHeader;
-    printf("copy assign BaseHeader %i %p = %p\n", flagsNextHeader, this, &in);
+    flagsUnused = in.flagsUnused;
+    headerSize = in.headerSize;
+    description = in.description;
+    FAKEMQ_TRACE("copy assign BaseHeader %i %p = %p\n", flagsNextHeader, this, &in);
     return *this;
   }
   BaseHeader& operator=(BaseHeader&& in) noexcept
   {
     flagsNextHeader = in.flagsNextHeader;
-    printf("move assign BaseHeader %i %p = %p\n", flagsNextHeader, this, &in);
+    flagsUnused = in.flagsUnused;
+    headerSize = in.headerSize;
+    description = in.description;
+    FAKEMQ_TRACE("move assign BaseHeader %i %p = %p\n", flagsNextHeader, this, &in);
     return *this;
   }
 
-  inline static const BaseHeader* get(const byte* b, size_t /*len*/ = 0)
+  /// the header at the start of the buffer. If the buffer length is given, nullptr unless the buffer holds
+  /// a complete header with valid magic and size.
+  inline static const BaseHeader* get(const byte* b, size_t len = 0)
   {
+    if (len > 0 && !fits(b, len)) {
+      return nullptr;
+    }
     return (const BaseHeader*)b;
   }
 
-  inline static BaseHeader* get(byte* b, size_t /*len*/ = 0)
+  inline static BaseHeader* get(byte* b, size_t len = 0)
   {
+    if (len > 0 && !fits(b, len)) {
+      return nullptr;
+    }
     return (BaseHeader*)b;
   }
 
+  inline static bool fits(const byte* b, size_t len) noexcept
+  {
+    if (!b || len < sizeof(BaseHeader)) {
+      return false;
+    }
+    const BaseHeader* h = reinterpret_cast<const BaseHeader*>(b);
+    return std::memcmp(h->magic, "O2O2", 4) == 0 && h->headerSize >= sizeof(BaseHeader) && h->headerSize <= len;
+  }
+
   /// get the next header if any (const version)
   inline const BaseHeader* next() const noexcept
   {
@@ -232,39 +547,164 @@ struct BaseHeader {
   {
     return (flagsNextHeader) ? reinterpret_cast<BaseHeader*>(reinterpret_cast<byte*>(this) + headerSize) : nullptr;
   }
+
+  /// get the next header if any and if it is complete and valid within the len bytes starting at this header
+  inline const BaseHeader* next(size_t len) const noexcept
+  {
+    return (flagsNextHeader && headerSize < len) ? get(data() + headerSize, len - headerSize) : nullptr;
+  }
 };
 
 using O2Message = FairMQParts;
 
 struct DataHeader : public BaseHeader {
   char contents[3]{ 'a', 'b', 'c' };
+  uint8_t checksumType{ 0 }; // 0: none, 1: CRC32C of the header stack and the payload, see validation.h
+  uint32_t checksum{ 0 };    // computed with this field zero
   uint64_t alignment{ 0 };
-  constexpr DataHeader() noexcept : BaseHeader{ sizeof(DataHeader) }
+
+  static constexpr HeaderType headerType() noexcept { return HeaderType{ "DataHead" }; }
+
+  constexpr DataHeader() noexcept : BaseHeader{ sizeof(DataHeader), headerType() }
   {
-    printf("default ctor DataHeader: %i @%p\n", flagsNextHeader, this);
+    FAKEMQ_TRACE("default ctor DataHeader: %i @%p\n", flagsNextHeader, this);
   }
   //~DataHeader() { printf("dtor DataHeader %i @%p\n", flagsNextHeader, this); }
-  DataHeader(const DataHeader& in) noexcept : BaseHeader{ sizeof(DataHeader) }
+  DataHeader(const DataHeader& in) noexcept : BaseHeader{ sizeof(DataHeader), headerType() }
   {
-    printf("copy ctor DataHeader %i %p -> %p\n", flagsNextHeader, &in, this);
+    FAKEMQ_TRACE("copy ctor DataHeader %i %p -> %p\n", flagsNextHeader, &in, this);
   }
-  DataHeader(const DataHeader&& in) noexcept : BaseHeader{ sizeof(DataHeader) }
+  DataHeader(const DataHeader&& in) noexcept : BaseHeader{ sizeof(DataHeader), headerType() }
   {
-    printf("move ctor DataHeader %i %p -> %p\n", flagsNextHeader, &in, this);
+    FAKEMQ_TRACE("move ctor DataHeader %i %p -> %p\n", flagsNextHeader, &in, this);
   }
   DataHeader& operator=(DataHeader& in) noexcept
   {
     flagsNextHeader = in.flagsNextHeader;
-    printf("copy assign DataHeader %i %p = %p\n", flagsNextHeader, this, &in);
+    FAKEMQ_TRACE("copy assign DataHeader %i %p = %p\n", flagsNextHeader, this, &in);
     return *this;
   }
   DataHeader& operator=(DataHeader&& in) noexcept
   {
     flagsNextHeader = in.flagsNextHeader;
-    printf("move assign DataHeader %i %p = %p\n", flagsNextHeader, this, &in);
+    FAKEMQ_TRACE("move assign DataHeader %i %p = %p\n", flagsNextHeader, this, &in);
     return *this;
   }
 };
+static_assert(sizeof(DataHeader) == 56, "the checksum lives in what used to be padding");
+
+//__________________________________________________________________________________________________
+/// Find the first header of type HeaderT (anything for BaseHeader) in a header stack of len bytes.
+/// The walk is bounds checked: nullptr if there is no such header or the chain is broken before it.
+template <typename HeaderT>
+const HeaderT* get(const byte* buffer, size_t len) noexcept
+{
+  static_assert(std::is_base_of<BaseHeader, HeaderT>::value, "headers must derive from BaseHeader");
+  size_t offset = 0;
+  while (len > offset) {
+    const BaseHeader* h = BaseHeader::get(buffer + offset, len - offset);
+    if (!h) {
+      return nullptr;
+    }
+    if ((std::is_same<HeaderT, BaseHeader>::value || h->description == HeaderT::headerType()) &&
+        h->headerSize >= sizeof(HeaderT)) {
+      return static_cast<const HeaderT*>(h);
+    }
+    if (!h->flagsNextHeader) {
+      return nullptr;
+    }
+    offset += h->headerSize;
+  }
+  return nullptr;
+}
+
+template <typename HeaderT>
+HeaderT* get(byte* buffer, size_t len) noexcept
+{
+  return const_cast<HeaderT*>(get<HeaderT>(const_cast<const byte*>(buffer), len));
+}
+
+//__________________________________________________________________________________________________
+/// Offsets of the headers in one stack by type, built with a single bounds checked walk so repeated lookups
+/// are O(1). Meant for consumers checking several headers of the same message. If a type is present more than
+/// once the first one is indexed, as with get<HeaderT>(). The buffer must outlive the index.
+class HeaderIndex {
+  struct Entry {
+    uint64_t type;
+    uint32_t offset;
+  };
+  static constexpr size_t nSlots = 64; // power of 2, twice the number of indexed headers
+
+ public:
+  static constexpr size_t maxHeaders = nSlots / 2;
+
+  HeaderIndex(const byte* buffer, size_t len) noexcept : mBuffer{ buffer }
+  {
+    size_t offset = 0;
+    while (len > offset && mCount < maxHeaders) {
+      const BaseHeader* h = BaseHeader::get(buffer + offset, len - offset);
+      if (!h) {
+        mComplete = false;
+        return;
+      }
+      insert(h->description.itg, offset);
+      ++mCount;
+      if (!h->flagsNextHeader) {
+        return;
+      }
+      offset += h->headerSize;
+    }
+    // the last header announced another one which is not there (or too many headers to index)
+    mComplete = false;
+  }
+
+  /// the first header of type HeaderT, nullptr if there is none
+  template <typename HeaderT>
+  const HeaderT* get() const noexcept
+  {
+    if (std::is_same<HeaderT, BaseHeader>::value) {
+      return mCount ? reinterpret_cast<const HeaderT*>(mBuffer) : nullptr;
+    }
+    const uint64_t type = HeaderT::headerType().itg;
+    for (size_t i = slot(type);; i = (i + 1) & (nSlots - 1)) {
+      if (mSlots[i].type == type) {
+        const BaseHeader* h = reinterpret_cast<const BaseHeader*>(mBuffer + mSlots[i].offset);
+        return h->headerSize >= sizeof(HeaderT) ? static_cast<const HeaderT*>(h) : nullptr;
+      }
+      if (mSlots[i].type == 0) {
+        return nullptr;
+      }
+    }
+  }
+
+  /// number of indexed headers
+  size_t size() const noexcept { return mCount; }
+  /// false if the chain was cut short by the buffer length or invalid headers
+  bool complete() const noexcept { return mComplete; }
+
+ private:
+  const byte* mBuffer{ nullptr };
+  size_t mCount{ 0 };
+  bool mComplete{ true };
+  Entry mSlots[nSlots]{};
+
+  static size_t slot(uint64_t type) noexcept { return (type * UINT64_C(0x9E3779B97F4A7C15)) >> 58; }
+
+  void insert(uint64_t type, size_t offset) noexcept
+  {
+    if (type == 0) {
+      return; // not a valid type, never looked up
+    }
+    size_t i = slot(type);
+    while (mSlots[i].type != 0) {
+      if (mSlots[i].type == type) {
+        return;
+      }
+      i = (i + 1) & (nSlots - 1);
+    }
+    mSlots[i] = Entry{ type, static_cast<uint32_t>(offset) };
+  }
+};
 
 struct Stack {
 
@@ -288,20 +728,54 @@ struct Stack {
   using value_type = byte;
   using BufferType = std::unique_ptr<value_type[], freeobj>;
 
+  /// stacks up to this size are stored inline, without an allocation
+  static constexpr size_t inlineCapacity() noexcept { return FAKEMQ_STACK_INLINE_BYTES; }
+
   Stack() = default;
-  Stack(Stack&&) = default;
   Stack(Stack&) = delete;
   Stack& operator=(Stack&) = delete;
-  Stack& operator=(Stack&&) = default;
+  Stack(Stack&& other) noexcept
+    : allocator{ other.allocator }, bufferSize{ other.bufferSize }, buffer{ std::move(other.buffer) }
+  {
+    takeInline(other);
+  }
+  Stack& operator=(Stack&& other) noexcept
+  {
+    if (this != &other) {
+      allocator = other.allocator;
+      bufferSize = other.bufferSize;
+      buffer = std::move(other.buffer);
+      takeInline(other);
+    }
+    return *this;
+  }
 
-  value_type* data() const { return buffer.get(); }
+  value_type* data() const
+  {
+    return buffer ? buffer.get() : inlineCapacity() && bufferSize ? const_cast<value_type*>(inlineBuffer) : nullptr;
+  }
   size_t size() const { return bufferSize; }
   allocator_type get_allocator() const { return allocator; }
+  /// true if the headers are stored in the stack object itself, i.e. data() dies with it
+  bool isInline() const noexcept { return inlineCapacity() && !buffer && bufferSize > 0; }
 
   //
   boost::container::pmr::memory_resource* getFreefnHint() const noexcept { return allocator.resource(); }
   static auto getFreefn() noexcept { return &freefn; }
 
+  /// give up the buffer, e.g. to a message created with getFreefn() and getFreefnHint() which frees it.
+  /// An inline stack is moved to a buffer of the allocator first, getMessage(Stack&&) hands it over without that.
+  value_type* release()
+  {
+    if (isInline()) {
+      BufferType spilled{ allocate(bufferSize) };
+      std::memcpy(spilled.get(), inlineBuffer, bufferSize);
+      buffer = std::move(spilled);
+    }
+    bufferSize = 0;
+    return buffer.release();
+  }
+
   /// The magic constructors: take arbitrary number of headers and serialize them
   /// into the buffer buffer allocated by the specified polymorphic allocator. By default
   /// allocation is done using new_delete_resource.
@@ -316,20 +790,136 @@ struct Stack {
   {
   }
 
+  /// If all arguments are headers (no stacks) of the size of their type, size, offsets and next-header flags are
+  /// known at compile time and the serialization is a straight sequence of fixed size copies.
   template <typename... Headers>
   Stack(const allocator_type allocatorArg, Headers&&... headers)
     : allocator{ allocatorArg },
-      bufferSize{ calculateSize(std::forward<Headers>(headers)...) },
-      buffer{ static_cast<byte*>(allocator.resource()->allocate(bufferSize, alignof(std::max_align_t))),
-              freeobj(getFreefnHint()) }
+      bufferSize{ stackSize(AllFixedSize<Headers...>{}, headers...) },
+      buffer{ bufferSize > inlineCapacity() ? allocate(bufferSize) : BufferType{ nullptr, freeobj{ getFreefnHint() } } }
   {
-    inject(buffer.get(), std::forward<Headers>(headers)...);
+    injectAll(AllFixedSize<Headers...>{}, data(), std::forward<Headers>(headers)...);
   }
 
+  /// compile time layout of a stack made of the given header types
+  template <typename... HeaderTypes>
+  struct FixedLayout {
+    static constexpr size_t size() noexcept { return offset(sizeof...(HeaderTypes)); }
+    static constexpr size_t offset(size_t index) noexcept
+    {
+      constexpr size_t sizes[] = { 0, sizeof(HeaderTypes)... }; // leading 0: never an empty array
+      size_t offset = 0;
+      for (size_t i = 1; i <= index; ++i) {
+        offset += sizes[i];
+      }
+      return offset;
+    }
+  };
+
  private:
   allocator_type allocator{ boost::container::pmr::new_delete_resource() };
   size_t bufferSize{ 0 };
   BufferType buffer{ nullptr, freeobj{ getFreefnHint() } };
+  // the headers if they fit and buffer is empty, not initialized otherwise
+  alignas(std::max_align_t) value_type inlineBuffer[FAKEMQ_STACK_INLINE_BYTES > 0 ? FAKEMQ_STACK_INLINE_BYTES : 1];
+
+  BufferType allocate(size_t bytes) const
+  {
+    return BufferType{ static_cast<byte*>(allocator.resource()->allocate(bytes, alignof(std::max_align_t))),
+                       freeobj(getFreefnHint()) };
+  }
+
+  // the second half of a move: copy the inline headers of other and leave it empty
+  void takeInline(Stack& other) noexcept
+  {
+    if (isInline()) {
+      std::memcpy(inlineBuffer, other.inlineBuffer, bufferSize);
+    }
+    other.bufferSize = 0;
+  }
+
+  template <typename T>
+  using Decayed = typename std::remove_cv<typename std::remove_reference<T>::type>::type;
+
+  // true if every argument is a header, i.e. has the fixed size of its type
+  template <typename... Args>
+  struct AllFixedSize : std::true_type {
+  };
+  template <typename T, typename... Args>
+  struct AllFixedSize<T, Args...>
+    : std::integral_constant<bool, std::is_base_of<BaseHeader, Decayed<T>>::value && AllFixedSize<Args...>::value> {
+  };
+
+  // the fixed layout needs the dynamic size of every header to match its type, a header passed by a base class
+  // reference (or extended by its producer) does not
+  template <typename... Headers>
+  static bool haveTypeSizes(const Headers&... headers) noexcept
+  {
+    bool match = true;
+    int expand[] = { 0, (match = match && headers.size() == sizeof(headers), 0)... };
+    static_cast<void>(expand);
+    return match;
+  }
+
+  template <typename... Headers>
+  static size_t stackSize(std::true_type, const Headers&... headers) noexcept
+  {
+    return haveTypeSizes(headers...) ? FixedLayout<Decayed<Headers>...>::size() : calculateSize(headers...);
+  }
+
+  template <typename... Headers>
+  static size_t stackSize(std::false_type, const Headers&... headers) noexcept
+  {
+    return calculateSize(headers...);
+  }
+
+  template <typename... Headers>
+  static void injectAll(std::true_type, byte* here, const Headers&... headers) noexcept
+  {
+    if (haveTypeSizes(headers...)) {
+      injectFixed(here, std::index_sequence_for<Headers...>{}, headers...);
+    }
+    else {
+      inject(here, headers...);
+    }
+  }
+
+  template <typename... Headers>
+  static void injectAll(std::false_type, byte* here, Headers&&... headers) noexcept
+  {
+    inject(here, std::forward<Headers>(headers)...);
+  }
+
+  template <typename... Headers, size_t... Is>
+  static void injectFixed(byte* here, std::index_sequence<Is...>, const Headers&... headers) noexcept
+  {
+    using Layout = FixedLayout<Headers...>;
+    constexpr bool inlined = Layout::size() <= inlineCapacity();
+    int expand[] = { 0,
+                     (placeHeader<Layout::offset(Is), Is + 1 == sizeof...(Headers), inlined>(here, headers), 0)... };
+    static_cast<void>(expand);
+  }
+
+  // The headers are mostly temporaries just written with 8 byte stores. The 16 byte loads a memcpy of them turns
+  // into miss the store forwarding, which stalls an inline stack: nothing (like the allocation of a heap stack) is
+  // in between to hide it. So into inline stacks headers are copied word by word, the empty asm keeps the compiler
+  // from merging the loads again.
+  template <size_t Offset, bool Last, bool Inlined, typename T>
+  static void placeHeader(byte* here, const T& h) noexcept
+  {
+    if (Inlined && sizeof(T) % sizeof(uint64_t) == 0) {
+      for (size_t i = 0; i < sizeof(T); i += sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, h.data() + i, sizeof(word));
+        asm("" : "+r"(word));
+        std::memcpy(here + Offset + i, &word, sizeof(word));
+      }
+    }
+    else {
+      std::memcpy(here + Offset, h.data(), sizeof(T));
+    }
+    reinterpret_cast<BaseHeader*>(here + Offset)->flagsNextHeader = !Last;
+  }
 
   template <typename T, typename... Args>
   static size_t calculateSize(T&& h, Args&&... args) noexcept
@@ -364,17 +954,29 @@ struct Stack {
   static byte* inject(byte* here, T&& h, Args&&... args) noexcept
   {
     auto alsohere = inject(here, h);
-    // the type might be a stack itself, loop through headers and set the flag in the last one
     if (h.size() > 0) {
-      BaseHeader* next = BaseHeader::get(here);
-      while (next->flagsNextHeader) {
-        next = next->next();
-      }
-      next->flagsNextHeader = hasNonEmptyArg(args...);
+      lastHeader(here, h)->flagsNextHeader = hasNonEmptyArg(args...);
     }
     return inject(alsohere, args...);
   }
 
+  // a header is its own last header
+  template <typename T>
+  static BaseHeader* lastHeader(byte* here, const T&) noexcept
+  {
+    return BaseHeader::get(here);
+  }
+
+  // the argument is a stack itself, loop through its headers to find the last one
+  static BaseHeader* lastHeader(byte* here, const Stack&) noexcept
+  {
+    BaseHeader* next = BaseHeader::get(here);
+    while (next->flagsNextHeader) {
+      next = next->next();
+    }
+    return next;
+  }
+
   // helper function to check if there is at least one non-empty header/stack in the argument pack
   template <typename T, typename... Args>
   static bool hasNonEmptyArg(const T& h, const Args&... args) noexcept
@@ -396,64 +998,218 @@ struct Stack {
 };
 
 
-void hexDump(const char* desc, const void* voidaddr, size_t len, size_t max = 512)
+namespace internal {
+//__________________________________________________________________________________________________
+/// two hex digits (high nibble first) and the printable representation ('.' otherwise) of 16 bytes
+inline void hexAscii16(const byte* in, char* hex, char* ascii) noexcept
 {
-  size_t i;
-  unsigned char buff[17]; // stores the ASCII data
-  memset(&buff[0], '\0', 17);
-  const byte* addr = reinterpret_cast<const byte*>(voidaddr);
+#ifdef __SSE2__
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  auto digits = [](__m128i n) {
+    __m128i letter = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+    return _mm_add_epi8(_mm_add_epi8(n, _mm_set1_epi8('0')), _mm_and_si128(letter, _mm_set1_epi8('a' - '0' - 10)));
+  };
+  __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+  __m128i high = digits(_mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+  __m128i low = digits(_mm_and_si128(v, nibble));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(hex), _mm_unpacklo_epi8(high, low));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(hex + 16), _mm_unpackhi_epi8(high, low));
+  // signed compares: everything from 0x80 up is negative and hence not printable either
+  __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1f)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7f)));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(ascii),
+                   _mm_or_si128(_mm_and_si128(printable, v), _mm_andnot_si128(printable, _mm_set1_epi8('.'))));
+#else
+  static const char digits[] = "0123456789abcdef";
+  for (int i = 0; i < 16; ++i) {
+    auto c = static_cast<unsigned int>(in[i]);
+    hex[2 * i] = digits[c >> 4];
+    hex[2 * i + 1] = digits[c & 0x0f];
+    ascii[i] = (c < 0x20 || c > 0x7e) ? '.' : static_cast<char>(c);
+  }
+#endif
+}
 
-  // Output description if given.
-  if (desc != nullptr)
-    printf("%s, ", desc);
-  printf("%zu bytes:", len);
-  if (max > 0 && len > max) {
-    len = max; // limit the output if requested
-    printf(" output limited to %zu bytes\n", len);
+//__________________________________________________________________________________________________
+/// Collects the formatted dump in a fixed buffer and hands it to the sink (a FILE or a file descriptor) only
+/// when it is full, so a dump of any size takes one write per buffer instead of one call per byte.
+class HexDumpWriter {
+public:
+  explicit HexDumpWriter(FILE* file) noexcept : mFile{ file } {}
+  explicit HexDumpWriter(int fd) noexcept : mFd{ fd } {}
+  HexDumpWriter(const HexDumpWriter&) = delete;
+  HexDumpWriter& operator=(const HexDumpWriter&) = delete;
+  ~HexDumpWriter() { flush(); }
+
+  static constexpr size_t maxLine() { return 128; }
+
+  /// room for at least maxLine() characters
+  char* line()
+  {
+    if (mUsed + maxLine() > sizeof(mBuffer)) {
+      flush();
+    }
+    return mBuffer + mUsed;
   }
-  else {
-    printf("\n");
+  void commit(const char* end) noexcept { mUsed = end - mBuffer; }
+
+  void append(const char* text, size_t length)
+  {
+    if (mUsed + length > sizeof(mBuffer)) {
+      flush();
+      if (length > sizeof(mBuffer)) {
+        put(text, length);
+        return;
+      }
+    }
+    memcpy(mBuffer + mUsed, text, length);
+    mUsed += length;
   }
+  void append(const char* text) { append(text, strlen(text)); }
 
-  // In case of null pointer addr
-  if (addr == nullptr) {
-    printf("  nullptr, size: %zu\n", len);
-    return;
+  void flush()
+  {
+    put(mBuffer, mUsed);
+    mUsed = 0;
+    if (mFile) {
+      fflush(mFile);
+    }
   }
 
-  // Process every byte in the data.
-  for (i = 0; i < len; i++) {
-    // Multiple of 16 means new line (with line offset).
-    if ((i % 16) == 0) {
-      // Just don't print ASCII for the zeroth line.
-      if (i != 0)
-        printf("  %s\n", buff);
+private:
+  char mBuffer[16384];
+  size_t mUsed{ 0 };
+  FILE* mFile{ nullptr };
+  int mFd{ -1 };
 
-      // Output the offset.
-      // printf ("  %04x ", i);
-      printf("  %p ", &addr[i]);
+  void put(const char* text, size_t length)
+  {
+    if (mFile) {
+      fwrite(text, 1, length, mFile);
+      return;
+    }
+    while (length > 0) {
+      ssize_t written = ::write(mFd, text, length);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return; // nowhere to report it, it is a debug print
+      }
+      text += written;
+      length -= written;
     }
+  }
+};
 
-    // Now the hex code for the specific character.
-    printf(" %02x", (unsigned int)addr[i]);
+/// same text as printf("%p") for a non-null pointer
+inline char* formatAddress(char* out, const void* address) noexcept
+{
+  static const char digits[] = "0123456789abcdef";
+  char reversed[2 * sizeof(uintptr_t)];
+  int n = 0;
+  auto value = reinterpret_cast<uintptr_t>(address);
+  do {
+    reversed[n++] = digits[value & 0x0f];
+    value >>= 4;
+  } while (value);
+  *out++ = '0';
+  *out++ = 'x';
+  while (n) {
+    *out++ = reversed[--n];
+  }
+  return out;
+}
 
-    // And store a printable ASCII character for later.
-    if (((const int)addr[i] < 0x20) || ((const int)addr[i] > 0x7e))
-      buff[i % 16] = '.';
-    else
-      buff[i % 16] = (const int)addr[i];
-    buff[(i % 16) + 1] = '\0';
-    fflush(stdout);
+/// "  <address>  xx xx ...  <ascii>\n" for up to 16 bytes, short lines are padded to keep the ASCII column
+inline char* formatHexLine(char* out, const byte* data, size_t n) noexcept
+{
+  char hex[32];
+  char ascii[16];
+  if (n == 16) {
+    hexAscii16(data, hex, ascii);
+  } else {
+    byte line[16] = {};
+    memcpy(line, data, n);
+    hexAscii16(line, hex, ascii);
+  }
+  *out++ = ' ';
+  *out++ = ' ';
+  out = formatAddress(out, data);
+  *out++ = ' ';
+  size_t i = 0;
+  for (; i < n; ++i) {
+    out[0] = ' ';
+    out[1] = hex[2 * i];
+    out[2] = hex[2 * i + 1];
+    out += 3;
+  }
+  for (; i < 16; ++i) {
+    out[0] = out[1] = out[2] = ' ';
+    out += 3;
+  }
+  *out++ = ' ';
+  *out++ = ' ';
+  memcpy(out, ascii, n);
+  out += n;
+  *out++ = '\n';
+  return out;
+}
+
+inline void hexDump(HexDumpWriter& writer, const char* desc, const void* voidaddr, size_t len, size_t max,
+                    bool squeeze)
+{
+  char header[128];
+  const byte* addr = reinterpret_cast<const byte*>(voidaddr);
+
+  if (desc != nullptr) {
+    writer.append(desc);
+    writer.append(", ", 2);
+  }
+  if (max > 0 && len > max) {
+    writer.append(header, snprintf(header, sizeof(header), "%zu bytes: output limited to %zu bytes\n", len, max));
+    len = max; // limit the output if requested
+  } else {
+    writer.append(header, snprintf(header, sizeof(header), "%zu bytes:\n", len));
+  }
+
+  if (addr == nullptr) {
+    writer.append(header, snprintf(header, sizeof(header), "  nullptr, size: %zu\n", len));
+    return;
+  }
+  if (len == 0) {
+    writer.append("  \n", 3);
+    return;
   }
 
-  // Pad out last line if not exactly 16 characters.
-  while ((i % 16) != 0) {
-    printf("   ");
-    fflush(stdout);
-    i++;
+  bool squeezed = false;
+  for (size_t i = 0; i < len; i += 16) {
+    size_t n = std::min<size_t>(16, len - i);
+    // like hexdump(1): a run of lines repeating the previous one is shown as a single '*'
+    if (squeeze && n == 16 && i > 0 && memcmp(addr + i, addr + i - 16, 16) == 0) {
+      if (!squeezed) {
+        writer.append("*\n", 2);
+        squeezed = true;
+      }
+      continue;
+    }
+    squeezed = false;
+    writer.commit(formatHexLine(writer.line(), addr + i, n));
   }
+}
+} // namespace internal
+
+//__________________________________________________________________________________________________
+/// Print a hex dump of (at most max, 0 means all) len bytes at voidaddr to stdout. The text is formatted in a
+/// buffer and passed on in large chunks, runs of identical 16 byte lines are collapsed to '*' unless squeeze is off.
+inline void hexDump(const char* desc, const void* voidaddr, size_t len, size_t max = 512, bool squeeze = true)
+{
+  internal::HexDumpWriter writer{ stdout };
+  internal::hexDump(writer, desc, voidaddr, len, max, squeeze);
+}
 
-  // And print the final ASCII bit.
-  printf("  %s\n", buff);
-  fflush(stdout);
+/// Same, but streamed straight to a file descriptor, meant for complete dumps of large messages.
+inline void hexDump(int fd, const char* desc, const void* voidaddr, size_t len, size_t max = 0, bool squeeze = true)
+{
+  internal::HexDumpWriter writer{ fd };
+  internal::hexDump(writer, desc, voidaddr, len, max, squeeze);
 }
@@ -0,0 +1,337 @@
+#pragma once
+#include "test.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Recording and replay of messages: FairMQPartsWriter appends FairMQParts to a file, MappedFileTransportFactory maps
+// such a file and hands out messages pointing straight into the mapping, so a replay neither reads nor copies.
+//
+// Layout: a RecordFileHeader, then one record per FairMQParts. A record is a RecordHeader, the used size of every part
+// (uint64_t each) and the payloads. The record header and every payload start at a multiple of the alignment of
+// the file, so a replayed buffer is as aligned as a heap message (or more) and can be adopted (adoptVector(),
+// adoptView()) or parsed (BaseHeader::get()) in place.
+
+namespace internal {
+//__________________________________________________________________________________________________
+struct RecordFileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t alignment; // of the records and payloads, a power of two
+  uint64_t reserved[6];
+};
+static_assert(sizeof(RecordFileHeader) == 64, "the file header is one cache line");
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t parts;
+  uint64_t bytes; // of the whole record including the padding, i.e. the distance to the next one
+};
+
+constexpr uint64_t recordFileMagic = UINT64_C(0x3130434552514d46); // "FMQREC01"
+constexpr uint32_t recordFileVersion = 1;
+constexpr uint32_t recordMagic = 0x44524352; // "RCRD"
+constexpr size_t recordMaxAlignment = 4096;
+
+inline uint64_t alignUp(uint64_t value, uint64_t alignment) noexcept { return (value + alignment - 1) & ~(alignment - 1); }
+
+//__________________________________________________________________________________________________
+/// A mapped file shared by the messages pointing into it, unmapped with the last of them.
+struct FileMapping {
+  std::atomic<size_t> refs;
+  void* base;
+  size_t length;
+};
+
+inline void unref(FileMapping* mapping) noexcept
+{
+  if (mapping->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    munmap(mapping->base, mapping->length);
+    delete mapping;
+  }
+}
+
+/// free function of the replayed messages, the hint is the mapping
+inline void releaseMapping(void* /*data*/, void* hint) { unref(static_cast<FileMapping*>(hint)); }
+
+/// recordMaxAlignment zero bytes, the source of the padding
+inline const byte* zeroPadding() noexcept
+{
+  alignas(64) static const byte padding[recordMaxAlignment] = {};
+  return padding;
+}
+
+/// writev() all chunks, resuming after short writes. The chunks are consumed. Throws what on failure.
+inline void writeAll(int fd, iovec* chunks, size_t n, const char* what)
+{
+  while (n > 0) {
+    int count = static_cast<int>(std::min<size_t>(n, IOV_MAX));
+    ssize_t written = ::writev(fd, chunks, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(what);
+    }
+    while (n > 0 && static_cast<size_t>(written) >= chunks->iov_len) {
+      written -= chunks->iov_len;
+      ++chunks;
+      --n;
+    }
+    if (n > 0) {
+      chunks->iov_base = static_cast<byte*>(chunks->iov_base) + written;
+      chunks->iov_len -= written;
+    }
+  }
+}
+}
+
+//__________________________________________________________________________________________________
+/// Appends FairMQParts (or single messages) to a record file, see MappedFileTransportFactory for the replay.
+/// A record goes out with a single writev() of the payloads as they are, padding included, nothing is copied.
+class FairMQPartsWriter {
+public:
+  /// create (or truncate) the file, alignment is the one of the records and payloads (a power of two, at least
+  /// alignof(std::max_align_t), at most 4096)
+  explicit FairMQPartsWriter(const std::string& path, size_t alignment = 64) : mAlignment{ alignment }
+  {
+    if (alignment < alignof(std::max_align_t) || alignment > internal::recordMaxAlignment ||
+        (alignment & (alignment - 1))) {
+      throw std::runtime_error("FairMQPartsWriter: bad alignment");
+    }
+    mFd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+    if (mFd < 0) {
+      throw std::runtime_error("FairMQPartsWriter: cannot create " + path);
+    }
+    internal::RecordFileHeader header{ internal::recordFileMagic, internal::recordFileVersion,
+                                       static_cast<uint32_t>(alignment), {} };
+    iovec chunk{ &header, sizeof(header) };
+    mOffset = 0;
+    put(&chunk, 1, sizeof(header));
+    pad();
+  }
+  FairMQPartsWriter(const FairMQPartsWriter&) = delete;
+  FairMQPartsWriter& operator=(const FairMQPartsWriter&) = delete;
+  ~FairMQPartsWriter()
+  {
+    if (mFd >= 0) {
+      close(mFd);
+    }
+  }
+
+  /// append the parts as one record, the used size of every message is recorded
+  void Write(const FairMQParts& parts) { write(parts.fParts.data(), parts.fParts.size()); }
+  /// append a record of one part
+  void Write(const FairMQMessage& message)
+  {
+    const FairMQMessage* part = &message;
+    write(&part, 1);
+  }
+  /// append a record of n parts
+  void Write(const FairMQMessagePtr* parts, size_t n) { write(parts, n); }
+
+  /// make the records written so far durable
+  void Sync()
+  {
+    if (fdatasync(mFd) != 0) {
+      throw std::runtime_error("FairMQPartsWriter: sync failed");
+    }
+  }
+
+  size_t GetAlignment() const noexcept { return mAlignment; }
+  /// bytes written so far, the file header included
+  uint64_t GetBytesWritten() const noexcept { return mOffset; }
+  size_t GetNumberOfRecords() const noexcept { return mRecords; }
+
+private:
+  int mFd{ -1 };
+  size_t mAlignment;
+  uint64_t mOffset{ 0 };
+  size_t mRecords{ 0 };
+  std::vector<iovec> mChunks;
+  std::vector<uint64_t> mSizes;
+
+  // a part is a FairMQMessagePtr or a plain pointer
+  template <typename PartT>
+  static const FairMQMessage& part(const PartT& p) noexcept
+  {
+    return *p;
+  }
+
+  template <typename PartT>
+  void write(const PartT* parts, size_t n)
+  {
+    internal::RecordHeader header{ internal::recordMagic, static_cast<uint32_t>(n), 0 };
+    mSizes.resize(n);
+    mChunks.clear();
+    mChunks.push_back({ &header, sizeof(header) });
+    mChunks.push_back({ mSizes.data(), n * sizeof(uint64_t) });
+    uint64_t bytes = sizeof(header) + n * sizeof(uint64_t);
+    addPadding(bytes);
+    for (size_t i = 0; i < n; ++i) {
+      const FairMQMessage& message = part(parts[i]);
+      mSizes[i] = message.GetUsedSize();
+      if (mSizes[i]) {
+        mChunks.push_back({ message.GetData(), mSizes[i] });
+      }
+      bytes += mSizes[i];
+      addPadding(bytes);
+    }
+    header.bytes = bytes;
+    put(mChunks.data(), mChunks.size(), bytes);
+    ++mRecords;
+  }
+
+  void addPadding(uint64_t& bytes)
+  {
+    uint64_t padded = internal::alignUp(bytes, mAlignment);
+    if (padded != bytes) {
+      mChunks.push_back({ const_cast<byte*>(internal::zeroPadding()), padded - bytes });
+      bytes = padded;
+    }
+  }
+
+  void pad()
+  {
+    uint64_t bytes = mOffset;
+    mChunks.clear();
+    addPadding(bytes);
+    if (!mChunks.empty()) {
+      put(mChunks.data(), mChunks.size(), bytes - mOffset);
+    }
+  }
+
+  void put(iovec* chunks, size_t n, uint64_t bytes)
+  {
+    mOffset += bytes;
+    internal::writeAll(mFd, chunks, n, "FairMQPartsWriter: write failed");
+  }
+};
+
+//__________________________________________________________________________________________________
+/// Replay of a file written by FairMQPartsWriter. The file is mapped once (copy on write, so the buffers may even
+/// be modified without touching the file), the records come back as FairMQParts whose messages point into the
+/// mapping: their free function only drops a reference on it, the file is unmapped with the last message (the
+/// factory holds one reference too). A truncated last record, e.g. of a recording that was cut short, is ignored.
+/// Messages allocated by this factory (CreateMessage(size)) are ordinary heap messages.
+class MappedFileTransportFactory : public FairMQTransportFactory {
+public:
+  explicit MappedFileTransportFactory(const std::string& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("MappedFileTransportFactory: cannot open " + path);
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(internal::RecordFileHeader)) {
+      close(fd);
+      throw std::runtime_error("MappedFileTransportFactory: not a record file " + path);
+    }
+    size_t length = info.st_size;
+    void* base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (base == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(base, length, MADV_SEQUENTIAL);
+#endif
+    mMapping = new internal::FileMapping{ { 1 }, base, length };
+    auto header = static_cast<const internal::RecordFileHeader*>(base);
+    if (header->magic != internal::recordFileMagic || header->version != internal::recordFileVersion ||
+        header->alignment < alignof(std::max_align_t) || header->alignment > internal::recordMaxAlignment ||
+        (header->alignment & (header->alignment - 1))) {
+      internal::unref(mMapping);
+      throw std::runtime_error("MappedFileTransportFactory: not a record file " + path);
+    }
+    mAlignment = header->alignment;
+    index();
+  }
+  MappedFileTransportFactory(const MappedFileTransportFactory&) = delete;
+  MappedFileTransportFactory& operator=(const MappedFileTransportFactory&) = delete;
+  ~MappedFileTransportFactory() override { internal::unref(mMapping); }
+
+  size_t GetNumberOfRecords() const noexcept { return mRecords.size(); }
+  size_t GetAlignment() const noexcept { return mAlignment; }
+  size_t GetFileSize() const noexcept { return mMapping->length; }
+
+  /// the parts of record i appended to parts
+  void ReadRecord(size_t i, FairMQParts& parts) const
+  {
+    if (i >= mRecords.size()) {
+      throw std::out_of_range("MappedFileTransportFactory: no such record");
+    }
+    auto base = static_cast<byte*>(mMapping->base);
+    auto header = reinterpret_cast<const internal::RecordHeader*>(base + mRecords[i]);
+    auto sizes = reinterpret_cast<const uint64_t*>(header + 1);
+    uint64_t offset = internal::alignUp(mRecords[i] + sizeof(*header) + header->parts * sizeof(uint64_t), mAlignment);
+    parts.fParts.reserve(parts.fParts.size() + header->parts);
+    for (uint32_t p = 0; p < header->parts; ++p) {
+      // the reference is taken once the message exists to give it back, nothing leaks if an allocation throws
+      auto message = CreateMessage(base + offset, sizes[p], &internal::releaseMapping, mMapping);
+      mMapping->refs.fetch_add(1, std::memory_order_relaxed);
+      parts.AddPart(std::move(message));
+      offset = internal::alignUp(offset + sizes[p], mAlignment);
+    }
+  }
+  FairMQParts ReadRecord(size_t i) const
+  {
+    FairMQParts parts;
+    ReadRecord(i, parts);
+    return parts;
+  }
+
+  /// the next record (in file order) as a receive would deliver it, false at the end
+  bool Receive(FairMQParts& parts)
+  {
+    if (mNext >= mRecords.size()) {
+      return false;
+    }
+    ReadRecord(mNext++, parts);
+    return true;
+  }
+  void Rewind() noexcept { mNext = 0; }
+
+private:
+  internal::FileMapping* mMapping{ nullptr };
+  size_t mAlignment{ 0 };
+  std::vector<uint64_t> mRecords; // offsets of the complete records
+  size_t mNext{ 0 };
+
+  // find the records, only the record headers are touched
+  void index()
+  {
+    auto base = static_cast<const byte*>(mMapping->base);
+    uint64_t length = mMapping->length;
+    uint64_t offset = internal::alignUp(sizeof(internal::RecordFileHeader), mAlignment);
+    while (offset + sizeof(internal::RecordHeader) <= length) {
+      auto header = reinterpret_cast<const internal::RecordHeader*>(base + offset);
+      uint64_t sizesEnd = offset + sizeof(*header) + uint64_t{ header->parts } * sizeof(uint64_t);
+      if (header->magic != internal::recordMagic || header->bytes > length - offset || sizesEnd > offset + header->bytes) {
+        break;
+      }
+      // the parts have to fit the record, nothing may point outside of the mapping
+      auto sizes = reinterpret_cast<const uint64_t*>(header + 1);
+      uint64_t end = internal::alignUp(sizesEnd, mAlignment);
+      for (uint32_t p = 0; p < header->parts && end <= offset + header->bytes; ++p) {
+        end = sizes[p] > length ? std::numeric_limits<uint64_t>::max() : internal::alignUp(end + sizes[p], mAlignment);
+      }
+      if (end > offset + header->bytes) {
+        break;
+      }
+      mRecords.push_back(offset);
+      offset += header->bytes;
+    }
+  }
+};
@@ -0,0 +1,454 @@
+#pragma once
+#include "filetransport.h"
+#include "test.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Stream format of (header Stack, payload) frames, for archiving to files and passing through pipes or sockets.
+//
+// Layout: a StreamHeader, the frames, an index and a trailer. A frame is a FrameHeader, the header stack and the
+// payload, each starting at a multiple of the alignment of the stream. The index (FrameIndexHeader and one
+// FrameIndexEntry per frame) follows the last frame, the trailer closes the stream: a reader of a seekable file finds
+// any frame through it without scanning, a reader of a pipe just stops at the index.
+
+//__________________________________________________________________________________________________
+/// where a frame is in the stream
+struct FrameIndexEntry {
+  uint64_t offset;
+  uint64_t headerBytes;
+  uint64_t payloadBytes;
+};
+
+namespace internal {
+//__________________________________________________________________________________________________
+struct StreamHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t alignment; // of the frames, header stacks and payloads, a power of two
+  uint64_t reserved[6];
+};
+static_assert(sizeof(StreamHeader) == 64, "the stream header is one cache line");
+
+struct FrameHeader {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t headerBytes;
+  uint64_t payloadBytes;
+  uint64_t frameBytes; // including the padding, i.e. the distance to the next frame
+};
+
+struct FrameIndexHeader {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t frames;
+};
+
+struct StreamTrailer {
+  uint64_t indexOffset;
+  uint64_t frames;
+  uint64_t reserved;
+  uint64_t magic;
+};
+
+constexpr uint64_t streamMagic = UINT64_C(0x3130525453514d46); // "FMQSTR01"
+constexpr uint32_t streamVersion = 1;
+constexpr uint32_t frameMagic = 0x454d5246;                     // "FRME"
+constexpr uint32_t frameIndexMagic = 0x58444e49;                // "INDX"
+constexpr uint64_t streamTrailerMagic = UINT64_C(0x444e45525453514d); // "MQSTREND"
+
+/// offsets of the parts of a frame from its start
+struct FrameLayout {
+  uint64_t header;
+  uint64_t payload;
+  uint64_t bytes;
+
+  FrameLayout(uint64_t headerBytes, uint64_t payloadBytes, uint64_t alignment) noexcept
+    : header{ alignUp(sizeof(FrameHeader), alignment) },
+      payload{ alignUp(header + headerBytes, alignment) },
+      bytes{ alignUp(payload + payloadBytes, alignment) }
+  {
+  }
+};
+
+inline void checkAlignment(size_t alignment, const char* what)
+{
+  if (alignment < alignof(std::max_align_t) || alignment > recordMaxAlignment || (alignment & (alignment - 1))) {
+    throw std::runtime_error(what);
+  }
+}
+}
+
+//__________________________________________________________________________________________________
+/// Tuning knobs of the FrameWriter, sizes in bytes.
+struct FrameWriterOptions {
+  size_t alignment{ 16 };         // of the frames, header stacks and payloads
+  size_t batchBytes{ 4 << 20 };   // small frames are collected up to this size and go out in one write
+  size_t directBytes{ 64 << 10 }; // larger payloads are written from their buffer instead of being copied
+};
+
+//__________________________________________________________________________________________________
+/// Writes (header Stack, payload) frames. Small frames are copied into a staging buffer which goes out as one large
+/// sequential write, a large payload is written straight from its buffer in the same writev() as whatever is staged.
+/// Close() (or the destructor) adds the index, the frames written until then are a readable stream on their own.
+class FrameWriter {
+public:
+  /// create (or truncate) the file
+  explicit FrameWriter(const std::string& path, FrameWriterOptions options = FrameWriterOptions{})
+    : FrameWriter(open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644), options, true)
+  {
+  }
+  /// write to fd (a file, pipe, socket, ...), the caller keeps the descriptor
+  explicit FrameWriter(int fd, FrameWriterOptions options = FrameWriterOptions{}) : FrameWriter(fd, options, false) {}
+  FrameWriter(const FrameWriter&) = delete;
+  FrameWriter& operator=(const FrameWriter&) = delete;
+  ~FrameWriter()
+  {
+    try {
+      Close();
+    }
+    catch (...) {
+      // nowhere to report it, Close() first to see the error
+    }
+    if (mOwnFd) {
+      close(mFd);
+    }
+  }
+
+  void Write(const Stack& headers, const FairMQMessage& payload)
+  {
+    Write(headers.data(), headers.size(), payload.GetData(), payload.GetUsedSize());
+  }
+  void Write(const void* headers, size_t headerBytes, const void* payload, size_t payloadBytes)
+  {
+    if (mClosed) {
+      throw std::runtime_error("FrameWriter: the stream is closed");
+    }
+    internal::FrameLayout layout(headerBytes, payloadBytes, mOptions.alignment);
+    internal::FrameHeader frame{ internal::frameMagic, 0, headerBytes, payloadBytes, layout.bytes };
+    mIndex.push_back(FrameIndexEntry{ position(), headerBytes, payloadBytes });
+    if (payloadBytes < mOptions.directBytes && layout.bytes <= mStaging.size()) {
+      if (layout.bytes > mStaging.size() - mUsed) {
+        Flush();
+      }
+      byte* out = mStaging.data() + mUsed;
+      std::memset(out, 0, layout.bytes);
+      std::memcpy(out, &frame, sizeof(frame));
+      if (headerBytes) {
+        std::memcpy(out + layout.header, headers, headerBytes);
+      }
+      if (payloadBytes) {
+        std::memcpy(out + layout.payload, payload, payloadBytes);
+      }
+      mUsed += layout.bytes;
+      return;
+    }
+    // gather: the staged frames and this one, the header stack and payload from where they are
+    const byte* zeros = internal::zeroPadding();
+    iovec chunks[] = { { mStaging.data(), mUsed },
+                       { &frame, sizeof(frame) },
+                       { const_cast<byte*>(zeros), layout.header - sizeof(frame) },
+                       { const_cast<void*>(headers), headerBytes },
+                       { const_cast<byte*>(zeros), layout.payload - layout.header - headerBytes },
+                       { const_cast<void*>(payload), payloadBytes },
+                       { const_cast<byte*>(zeros), layout.bytes - layout.payload - payloadBytes } };
+    internal::writeAll(mFd, chunks, sizeof(chunks) / sizeof(chunks[0]), "FrameWriter: write failed");
+    mWritten += mUsed + layout.bytes;
+    mUsed = 0;
+  }
+
+  /// hand the staged frames to the file descriptor
+  void Flush()
+  {
+    if (mUsed) {
+      iovec chunk{ mStaging.data(), mUsed };
+      internal::writeAll(mFd, &chunk, 1, "FrameWriter: write failed");
+      mWritten += mUsed;
+      mUsed = 0;
+    }
+  }
+
+  /// write the index and the trailer, nothing can be written afterwards
+  void Close()
+  {
+    if (mClosed) {
+      return;
+    }
+    Flush();
+    mClosed = true;
+    internal::FrameIndexHeader index{ internal::frameIndexMagic, 0, mIndex.size() };
+    internal::StreamTrailer trailer{ mWritten, mIndex.size(), 0, internal::streamTrailerMagic };
+    iovec chunks[] = { { &index, sizeof(index) },
+                       { mIndex.data(), mIndex.size() * sizeof(FrameIndexEntry) },
+                       { &trailer, sizeof(trailer) } };
+    internal::writeAll(mFd, chunks, 3, "FrameWriter: write failed");
+    mWritten += sizeof(index) + mIndex.size() * sizeof(FrameIndexEntry) + sizeof(trailer);
+  }
+
+  size_t GetNumberOfFrames() const noexcept { return mIndex.size(); }
+  /// bytes handed to the file descriptor so far
+  uint64_t GetBytesWritten() const noexcept { return mWritten; }
+
+private:
+  int mFd{ -1 };
+  bool mOwnFd{ false };
+  bool mClosed{ false };
+  FrameWriterOptions mOptions;
+  std::vector<byte> mStaging;
+  size_t mUsed{ 0 };
+  uint64_t mWritten{ 0 };
+  std::vector<FrameIndexEntry> mIndex;
+
+  FrameWriter(int fd, FrameWriterOptions options, bool own) : mFd{ fd }, mOwnFd{ own }, mOptions{ options }
+  {
+    if (mFd < 0) {
+      throw std::runtime_error("FrameWriter: cannot open the stream");
+    }
+    try {
+      internal::checkAlignment(mOptions.alignment, "FrameWriter: bad alignment");
+      mStaging.resize(std::max(mOptions.batchBytes, internal::alignUp(sizeof(internal::StreamHeader), mOptions.alignment)));
+    }
+    catch (...) {
+      if (mOwnFd) {
+        close(mFd);
+      }
+      throw;
+    }
+    internal::StreamHeader header{ internal::streamMagic, internal::streamVersion,
+                                   static_cast<uint32_t>(mOptions.alignment), {} };
+    mUsed = internal::alignUp(sizeof(header), mOptions.alignment);
+    std::memset(mStaging.data(), 0, mUsed);
+    std::memcpy(mStaging.data(), &header, sizeof(header));
+  }
+
+  uint64_t position() const noexcept { return mWritten + mUsed; }
+};
+
+//__________________________________________________________________________________________________
+/// A frame as returned by the FrameReader: two messages pointing into the read buffer, no copy involved. They keep
+/// the buffer alive, so they can be adopted (adoptView(), adoptVector()), parsed (get<DataHeader>()) or sent on.
+struct Frame {
+  uint64_t offset{ 0 };       // in the stream
+  FairMQMessagePtr header;    // the header stack
+  FairMQMessagePtr payload;
+};
+
+//__________________________________________________________________________________________________
+/// Tuning knobs of the FrameReader, sizes in bytes.
+struct FrameReaderOptions {
+  size_t chunkBytes{ 4 << 20 }; // read buffer, larger frames get a buffer of their own
+  size_t readahead{ 2 };        // chunks the kernel is asked to prefetch beyond the one being read (files only)
+};
+
+//__________________________________________________________________________________________________
+/// Reads a stream of frames in large chunks into message buffers and hands the frames out as messages sharing the
+/// chunk (see SharedMessage::share()). A chunk is reused once all frames read from it are gone, the (partial) frame
+/// at its end is moved to the start of the next one. On files the kernel is asked to read the next chunks ahead.
+class FrameReader {
+public:
+  explicit FrameReader(const std::string& path, FrameReaderOptions options = FrameReaderOptions{},
+                       const FairMQTransportFactory* factory = nullptr)
+    : FrameReader(open(path.c_str(), O_RDONLY | O_CLOEXEC), options, factory, true)
+  {
+  }
+  /// read from fd (a file, pipe, socket, ...), the caller keeps the descriptor. The chunks are messages of factory
+  /// (a heap transport if nullptr).
+  explicit FrameReader(int fd, FrameReaderOptions options = FrameReaderOptions{},
+                       const FairMQTransportFactory* factory = nullptr)
+    : FrameReader(fd, options, factory, false)
+  {
+  }
+  FrameReader(const FrameReader&) = delete;
+  FrameReader& operator=(const FrameReader&) = delete;
+  ~FrameReader()
+  {
+    if (mOwnFd) {
+      close(mFd);
+    }
+  }
+
+  /// the next frame, false at the end of the stream (a truncated last frame included)
+  bool Read(Frame& frame)
+  {
+    if (mEnd || !fill(sizeof(internal::FrameHeader))) {
+      return false;
+    }
+    internal::FrameHeader header;
+    std::memcpy(&header, mData + mPos, sizeof(header));
+    if (header.magic == internal::frameIndexMagic) {
+      mEnd = true;
+      return false;
+    }
+    internal::FrameLayout layout(header.headerBytes, header.payloadBytes, mAlignment);
+    if (header.magic != internal::frameMagic || header.frameBytes != layout.bytes) {
+      throw std::runtime_error("FrameReader: corrupt stream");
+    }
+    if (!fill(layout.bytes)) {
+      return false;
+    }
+    frame.offset = mChunkOffset + mPos;
+    frame.header = mChunk.share(mPos + layout.header, header.headerBytes, mFactory);
+    frame.payload = mChunk.share(mPos + layout.payload, header.payloadBytes, mFactory);
+    mPos += layout.bytes;
+    return true;
+  }
+
+  /// the index at the end of the stream, seekable files only
+  std::vector<FrameIndexEntry> ReadIndex() const
+  {
+    struct stat info;
+    internal::StreamTrailer trailer;
+    if (fstat(mFd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(trailer) ||
+        pread(mFd, &trailer, sizeof(trailer), info.st_size - sizeof(trailer)) != sizeof(trailer) ||
+        trailer.magic != internal::streamTrailerMagic) {
+      throw std::runtime_error("FrameReader: no index, the stream was not closed or is not a file");
+    }
+    internal::FrameIndexHeader header;
+    std::vector<FrameIndexEntry> index(trailer.frames);
+    size_t bytes = index.size() * sizeof(FrameIndexEntry);
+    if (pread(mFd, &header, sizeof(header), trailer.indexOffset) != sizeof(header) ||
+        header.magic != internal::frameIndexMagic || header.frames != trailer.frames ||
+        pread(mFd, index.data(), bytes, trailer.indexOffset + sizeof(header)) != static_cast<ssize_t>(bytes)) {
+      throw std::runtime_error("FrameReader: corrupt index");
+    }
+    return index;
+  }
+
+  /// continue with the frame at offset (see ReadIndex()), seekable files only
+  void Seek(uint64_t offset)
+  {
+    if (lseek(mFd, offset, SEEK_SET) < 0) {
+      throw std::runtime_error("FrameReader: the stream is not seekable");
+    }
+    if (!mChunk.unique()) {
+      dropChunk(); // frames still point into it, it must not be overwritten
+    }
+    mChunkOffset = offset;
+    mPos = mFilled = 0;
+    mEnd = mEof = false;
+    mFileOffset = offset;
+  }
+
+private:
+  int mFd{ -1 };
+  bool mOwnFd{ false };
+  FrameReaderOptions mOptions;
+  const FairMQTransportFactory* mFactory{ nullptr };
+  FairMQTransportFactory mHeap{};
+  size_t mAlignment{ 0 };
+  SharedMessage mChunk;
+  byte* mData{ nullptr };
+  size_t mCapacity{ 0 };
+  size_t mFilled{ 0 };       // valid bytes in the chunk
+  size_t mPos{ 0 };          // of the next frame in the chunk
+  uint64_t mChunkOffset{ 0 }; // stream offset of the start of the chunk
+  uint64_t mFileOffset{ 0 };  // of the next read
+  bool mEof{ false };
+  bool mEnd{ false };
+
+  FrameReader(int fd, FrameReaderOptions options, const FairMQTransportFactory* factory, bool own)
+    : mFd{ fd }, mOwnFd{ own }, mOptions{ options }, mFactory{ factory ? factory : &mHeap }
+  {
+    if (mFd < 0) {
+      throw std::runtime_error("FrameReader: cannot open the stream");
+    }
+    try {
+      internal::StreamHeader header;
+      mAlignment = internal::recordMaxAlignment; // until the header tells, for the first chunk
+      if (!fill(sizeof(header))) {
+        throw std::runtime_error("FrameReader: not a frame stream");
+      }
+      std::memcpy(&header, mData, sizeof(header));
+      if (header.magic != internal::streamMagic || header.version != internal::streamVersion) {
+        throw std::runtime_error("FrameReader: not a frame stream");
+      }
+      internal::checkAlignment(header.alignment, "FrameReader: bad alignment");
+      mAlignment = header.alignment;
+      mPos = internal::alignUp(sizeof(header), mAlignment);
+    }
+    catch (...) {
+      if (mOwnFd) {
+        close(mFd);
+      }
+      throw;
+    }
+  }
+
+  // make sure bytes from mPos on are in the chunk, false if the stream ends before
+  bool fill(size_t bytes)
+  {
+    if (mFilled - mPos >= bytes) {
+      return true;
+    }
+    if (mPos + bytes > mCapacity) {
+      nextChunk(bytes);
+    }
+    while (mFilled - mPos < bytes && !mEof) {
+      ssize_t n = ::read(mFd, mData + mFilled, mCapacity - mFilled);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::runtime_error("FrameReader: read failed");
+      }
+      mEof = n == 0;
+      mFilled += n;
+      mFileOffset += n;
+    }
+    if (!mEof && mOptions.readahead) {
+      // prefetch: the next chunks are read into the page cache while this one is processed
+      posix_fadvise(mFd, mFileOffset, mOptions.readahead * mOptions.chunkBytes, POSIX_FADV_WILLNEED);
+    }
+    return mFilled - mPos >= bytes;
+  }
+
+  // continue in a chunk with room for bytes from its start, the bytes after mPos are carried over. The current
+  // chunk is reused if no frame points into it any more.
+  void nextChunk(size_t bytes)
+  {
+    size_t carry = mFilled - mPos;
+    size_t capacity = std::max(mOptions.chunkBytes, internal::alignUp(bytes, mAlignment));
+    if (mChunk.unique() && capacity <= mCapacity) {
+      std::memmove(mData, mData + mPos, carry);
+    }
+    else {
+      auto buffer = newBuffer(capacity);
+      auto data = static_cast<byte*>(buffer->GetData());
+      if (carry) {
+        std::memcpy(data, mData + mPos, carry);
+      }
+      // only the bytes past mFilled are ever written, the frames handed out are never touched
+      mChunk = SharedMessage(std::move(buffer), mFactory);
+      mData = data;
+      mCapacity = capacity;
+    }
+    mChunkOffset += mPos;
+    mFilled = carry;
+    mPos = 0;
+  }
+
+  void dropChunk() noexcept
+  {
+    mChunk = SharedMessage{};
+    mData = nullptr;
+    mCapacity = 0;
+  }
+
+  FairMQMessagePtr newBuffer(size_t capacity) const
+  {
+    // the frames keep their alignment in the chunk, it has to be aligned as the stream
+    if (mAlignment > alignof(std::max_align_t)) {
+      auto messages = mFactory->CreateMessages(&capacity, 1, mAlignment);
+      return std::move(messages[0]);
+    }
+    return mFactory->CreateMessage(capacity);
+  }
+};
@@ -0,0 +1,320 @@
+#pragma once
+#include "test.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// In-process hand over of messages (or whole FairMQParts) between pipeline stages running on different threads:
+// bounded lock-free queues moving the unique_ptrs, the payload itself is never touched.
+
+namespace internal {
+// the producer and the consumer side of a queue live on different cache lines
+constexpr size_t queueCacheLine = 64;
+
+inline size_t queueCapacity(size_t capacity)
+{
+  size_t rounded = 2;
+  while (rounded < capacity) {
+    rounded *= 2;
+  }
+  return rounded;
+}
+}
+
+//__________________________________________________________________________________________________
+/// Bounded single producer, single consumer queue. The capacity is rounded up to a power of two.
+/// tryPush()/tryPop() never block, push()/pop() yield until they can proceed. The batch versions move a
+/// whole range with a single publication, i.e. one atomic store per batch instead of one per element.
+template <typename T>
+class SPSCQueue {
+  using Storage = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+public:
+  using value_type = T;
+
+  explicit SPSCQueue(size_t capacity)
+    : mMask{ internal::queueCapacity(capacity) - 1 }, mSlots{ new Storage[mMask + 1] }
+  {
+  }
+  SPSCQueue(const SPSCQueue&) = delete;
+  SPSCQueue& operator=(const SPSCQueue&) = delete;
+  ~SPSCQueue()
+  {
+    for (size_t i = mHead.load(std::memory_order_relaxed); i != mTail.load(std::memory_order_relaxed); ++i) {
+      slot(i)->~T();
+    }
+  }
+
+  size_t capacity() const noexcept { return mMask + 1; }
+  /// only exact if the other side is idle
+  size_t size() const noexcept
+  {
+    return mTail.load(std::memory_order_acquire) - mHead.load(std::memory_order_acquire);
+  }
+  bool empty() const noexcept { return size() == 0; }
+
+  /// producer: move up to n values in, returns how many were taken (always the first ones)
+  size_t tryPush(T* values, size_t n)
+  {
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    if (mHeadCache + capacity() - tail < n) {
+      mHeadCache = mHead.load(std::memory_order_acquire);
+    }
+    size_t count = std::min(n, mHeadCache + capacity() - tail);
+    for (size_t i = 0; i < count; ++i) {
+      new (slot(tail + i)) T(std::move(values[i]));
+    }
+    if (count) {
+      mTail.store(tail + count, std::memory_order_release);
+    }
+    return count;
+  }
+  /// producer: false (and the value is left alone) if the queue is full
+  bool tryPush(T& value) { return tryPush(&value, 1) == 1; }
+  void push(T* values, size_t n)
+  {
+    size_t done = tryPush(values, n);
+    while (done < n) {
+      std::this_thread::yield();
+      done += tryPush(values + done, n - done);
+    }
+  }
+  void push(T value) { push(&value, 1); }
+
+  /// consumer: move up to n values out, returns how many
+  size_t tryPop(T* values, size_t n)
+  {
+    size_t head = mHead.load(std::memory_order_relaxed);
+    if (mTailCache - head < n) {
+      mTailCache = mTail.load(std::memory_order_acquire);
+    }
+    size_t count = std::min(n, mTailCache - head);
+    for (size_t i = 0; i < count; ++i) {
+      T* element = slot(head + i);
+      values[i] = std::move(*element);
+      element->~T();
+    }
+    if (count) {
+      mHead.store(head + count, std::memory_order_release);
+    }
+    return count;
+  }
+  bool tryPop(T& value) { return tryPop(&value, 1) == 1; }
+  void pop(T* values, size_t n)
+  {
+    size_t done = tryPop(values, n);
+    while (done < n) {
+      std::this_thread::yield();
+      done += tryPop(values + done, n - done);
+    }
+  }
+  T pop()
+  {
+    T value;
+    pop(&value, 1);
+    return value;
+  }
+
+private:
+  // producer
+  alignas(internal::queueCacheLine) std::atomic<size_t> mTail{ 0 };
+  size_t mHeadCache{ 0 };
+  // consumer
+  alignas(internal::queueCacheLine) std::atomic<size_t> mHead{ 0 };
+  size_t mTailCache{ 0 };
+  // shared, read only
+  alignas(internal::queueCacheLine) const size_t mMask;
+  std::unique_ptr<Storage[]> mSlots;
+
+  T* slot(size_t i) const noexcept { return reinterpret_cast<T*>(&mSlots[i & mMask]); }
+};
+
+//__________________________________________________________________________________________________
+/// Bounded multi producer, multi consumer queue (D. Vyukov's design): every cell carries a sequence number
+/// telling whether it is free for the producer of that round or ready for its consumer, so producers and
+/// consumers only contend on their own position counter. A batch claims a run of consecutive cells with a
+/// single CAS. Same interface as the SPSCQueue.
+template <typename T>
+class MPMCQueue {
+  struct Cell {
+    std::atomic<size_t> sequence;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+public:
+  using value_type = T;
+
+  explicit MPMCQueue(size_t capacity) : mMask{ internal::queueCapacity(capacity) - 1 }, mCells{ new Cell[mMask + 1] }
+  {
+    for (size_t i = 0; i <= mMask; ++i) {
+      mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+  MPMCQueue(const MPMCQueue&) = delete;
+  MPMCQueue& operator=(const MPMCQueue&) = delete;
+  ~MPMCQueue()
+  {
+    for (size_t i = mDequeuePos.load(std::memory_order_relaxed); i != mEnqueuePos.load(std::memory_order_relaxed);
+         ++i) {
+      element(cell(i))->~T();
+    }
+  }
+
+  size_t capacity() const noexcept { return mMask + 1; }
+  /// only exact if nobody pushes or pops at the same time
+  size_t size() const noexcept
+  {
+    size_t dequeued = mDequeuePos.load(std::memory_order_acquire);
+    size_t enqueued = mEnqueuePos.load(std::memory_order_acquire);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
+  bool empty() const noexcept { return size() == 0; }
+
+  size_t tryPush(T* values, size_t n)
+  {
+    if (n == 0) {
+      return 0;
+    }
+    size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      auto diff = static_cast<intptr_t>(cell(pos).sequence.load(std::memory_order_acquire) - pos);
+      if (diff < 0) {
+        return 0; // full
+      }
+      if (diff > 0) {
+        pos = mEnqueuePos.load(std::memory_order_relaxed); // another producer was faster
+        continue;
+      }
+      size_t count = 1;
+      while (count < n && cell(pos + count).sequence.load(std::memory_order_acquire) == pos + count) {
+        ++count;
+      }
+      if (mEnqueuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+        for (size_t i = 0; i < count; ++i) {
+          Cell& target = cell(pos + i);
+          new (&target.storage) T(std::move(values[i]));
+          target.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return count;
+      }
+    }
+  }
+  bool tryPush(T& value) { return tryPush(&value, 1) == 1; }
+  void push(T* values, size_t n)
+  {
+    size_t done = tryPush(values, n);
+    while (done < n) {
+      std::this_thread::yield();
+      done += tryPush(values + done, n - done);
+    }
+  }
+  void push(T value) { push(&value, 1); }
+
+  size_t tryPop(T* values, size_t n)
+  {
+    if (n == 0) {
+      return 0;
+    }
+    size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+    for (;;) {
+      auto diff = static_cast<intptr_t>(cell(pos).sequence.load(std::memory_order_acquire) - (pos + 1));
+      if (diff < 0) {
+        return 0; // empty
+      }
+      if (diff > 0) {
+        pos = mDequeuePos.load(std::memory_order_relaxed); // another consumer was faster
+        continue;
+      }
+      size_t count = 1;
+      while (count < n && cell(pos + count).sequence.load(std::memory_order_acquire) == pos + count + 1) {
+        ++count;
+      }
+      if (mDequeuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+        for (size_t i = 0; i < count; ++i) {
+          Cell& source = cell(pos + i);
+          values[i] = std::move(*element(source));
+          element(source)->~T();
+          source.sequence.store(pos + i + mMask + 1, std::memory_order_release);
+        }
+        return count;
+      }
+    }
+  }
+  bool tryPop(T& value) { return tryPop(&value, 1) == 1; }
+  void pop(T* values, size_t n)
+  {
+    size_t done = tryPop(values, n);
+    while (done < n) {
+      std::this_thread::yield();
+      done += tryPop(values + done, n - done);
+    }
+  }
+  T pop()
+  {
+    T value;
+    pop(&value, 1);
+    return value;
+  }
+
+private:
+  alignas(internal::queueCacheLine) std::atomic<size_t> mEnqueuePos{ 0 };
+  alignas(internal::queueCacheLine) std::atomic<size_t> mDequeuePos{ 0 };
+  alignas(internal::queueCacheLine) const size_t mMask;
+  std::unique_ptr<Cell[]> mCells;
+
+  Cell& cell(size_t i) const noexcept { return mCells[i & mMask]; }
+  static T* element(Cell& c) noexcept { return reinterpret_cast<T*>(&c.storage); }
+};
+
+using SPSCMessageQueue = SPSCQueue<FairMQMessagePtr>;
+using MPMCMessageQueue = MPMCQueue<FairMQMessagePtr>;
+using SPSCPartsQueue = SPSCQueue<FairMQParts>;
+using MPMCPartsQueue = MPMCQueue<FairMQParts>;
+
+//__________________________________________________________________________________________________
+/// queue the parts one message each, in order, as a single batch where possible. parts is left empty.
+template <typename QueueT>
+void pushParts(QueueT& queue, FairMQParts& parts)
+{
+  queue.push(parts.fParts.data(), parts.fParts.size());
+  parts.fParts.clear();
+}
+
+/// append n messages from the queue to parts
+template <typename QueueT>
+void popParts(QueueT& queue, FairMQParts& parts, size_t n)
+{
+  size_t first = parts.fParts.size();
+  parts.fParts.resize(first + n);
+  queue.pop(parts.fParts.data() + first, n);
+}
+
+//__________________________________________________________________________________________________
+/// hand a container built on this thread to another one without a copy: the message behind it is queued
+/// (see getMessage()), the consumer adopts it with popView() or adoptVector()
+template <typename QueueT, typename ContainerT>
+void pushContainer(QueueT& queue, ContainerT&& container)
+{
+  auto message = getMessage(std::forward<ContainerT>(container));
+  if (!message) {
+    throw std::runtime_error("pushContainer: the container does not own a message");
+  }
+  queue.push(std::move(message));
+}
+
+/// take the next message from the queue and view its used bytes as an array of ElemT, upstream (optional) is the
+/// resource the message came from
+template <typename ElemT, typename QueueT>
+MessageView<ElemT> popView(QueueT& queue, FairMQMemoryResource* upstream = nullptr)
+{
+  auto message = queue.pop();
+  size_t nelem = message->GetUsedSize() / sizeof(ElemT);
+  return MessageView<ElemT>(nelem, std::move(message), upstream);
+}
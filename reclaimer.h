@@ -0,0 +1,156 @@
+#pragma once
+#include "messagequeue.h"
+#include "test.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+//__________________________________________________________________________________________________
+/// Tuning knobs of the BackgroundReclaimer.
+struct ReclaimerOptions {
+  size_t capacity{ 4096 };     // messages waiting for the reclaimer at most
+  size_t minBytes{ 1 << 16 };  // smaller messages are cheaper to free right away than to queue
+  bool blockWhenFull{ false }; // backpressure: wait for room (true) or free on the calling thread (false)
+};
+
+//__________________________________________________________________________________________________
+struct ReclaimerStats {
+  size_t deferred{ 0 };  // messages queued
+  size_t inlined{ 0 };   // messages freed by the caller, too small or the queue was full
+  size_t reclaimed{ 0 }; // queued messages freed by the reclaimer
+  size_t backlog{ 0 };   // queued messages not freed yet
+};
+
+//__________________________________________________________________________________________________
+/// Frees messages on a background thread, so dropping a large container (or a FairMQParts, see retire()) does
+/// not stall the thread doing it with the free (and poisoning, unmapping, ...) of the buffer.
+/// Plug it into a resource with FairMQMemoryResource::setReclaimer(): the messages of the buffers deallocated
+/// through the resource and of the adoptVector()/adoptView() adoptions on top of it are then queued here through
+/// a bounded lock-free queue, users of getMessage()/adoptVector() do not change. The destructor frees whatever is
+/// still queued, so the reclaimer has to outlive the resources using it.
+class BackgroundReclaimer : public MessageReclaimer {
+public:
+  explicit BackgroundReclaimer(ReclaimerOptions options = ReclaimerOptions{})
+    : mOptions{ options }, mQueue{ options.capacity }, mThread{ [this] { run(); } }
+  {
+  }
+  BackgroundReclaimer(const BackgroundReclaimer&) = delete;
+  BackgroundReclaimer& operator=(const BackgroundReclaimer&) = delete;
+  ~BackgroundReclaimer()
+  {
+    {
+      std::lock_guard<std::mutex> guard(mMutex);
+      mStop = true;
+    }
+    mWake.notify_one();
+    mThread.join();
+  }
+
+  /// free the message on the reclaimer's thread: never blocks unless blockWhenFull is set and the queue is full
+  void retire(FairMQMessagePtr message) noexcept override
+  {
+    if (!message) {
+      return;
+    }
+    if (message->GetSize() < mOptions.minBytes) {
+      mInlined.fetch_add(1, std::memory_order_relaxed);
+      return; // dies here
+    }
+    size_t pending = mPending.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (!mQueue.tryPush(message)) {
+      if (!mOptions.blockWhenFull) {
+        mPending.fetch_sub(1, std::memory_order_relaxed);
+        mInlined.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      wake();
+      mQueue.push(std::move(message));
+    }
+    mDeferred.fetch_add(1, std::memory_order_relaxed);
+    // an idle reclaimer polls anyway, it is only woken up early for a whole batch to keep this path cheap
+    if (pending >= batch() && mIdle.load(std::memory_order_relaxed)) {
+      wake();
+    }
+  }
+
+  /// free all messages of parts, parts is left empty
+  void retire(FairMQParts& parts) noexcept
+  {
+    for (auto& message : parts.fParts) {
+      retire(std::move(message));
+    }
+    parts.fParts.clear();
+  }
+
+  /// wait until everything queued so far is freed
+  void drain()
+  {
+    wake();
+    while (mPending.load(std::memory_order_acquire) > 0) {
+      std::this_thread::yield();
+    }
+  }
+
+  ReclaimerStats getStats() const noexcept
+  {
+    ReclaimerStats stats;
+    stats.deferred = mDeferred.load(std::memory_order_relaxed);
+    stats.inlined = mInlined.load(std::memory_order_relaxed);
+    stats.reclaimed = mReclaimed.load(std::memory_order_relaxed);
+    stats.backlog = mPending.load(std::memory_order_relaxed);
+    return stats;
+  }
+
+  const ReclaimerOptions& getOptions() const noexcept { return mOptions; }
+
+private:
+  static constexpr size_t batch() { return 64; }
+  static constexpr std::chrono::microseconds pollInterval() { return std::chrono::microseconds(500); }
+
+  const ReclaimerOptions mOptions;
+  MPMCMessageQueue mQueue;
+  std::atomic<size_t> mPending{ 0 };
+  std::atomic<size_t> mDeferred{ 0 };
+  std::atomic<size_t> mInlined{ 0 };
+  std::atomic<size_t> mReclaimed{ 0 };
+  std::atomic<bool> mIdle{ false };
+  std::mutex mMutex;
+  std::condition_variable mWake;
+  bool mStop{ false };
+  std::thread mThread; // last, it runs on the members above
+
+  // no lock: a notification missed by a reclaimer just about to wait only costs one poll interval
+  void wake() noexcept { mWake.notify_one(); }
+
+  void run()
+  {
+    FairMQMessagePtr messages[batch()];
+    for (;;) {
+      size_t n = mQueue.tryPop(messages, batch());
+      if (n > 0) {
+        for (size_t i = 0; i < n; ++i) {
+          messages[i] = nullptr;
+        }
+        mReclaimed.fetch_add(n, std::memory_order_relaxed);
+        mPending.fetch_sub(n, std::memory_order_release);
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(mMutex);
+      if (mStop) {
+        if (mQueue.empty()) {
+          return;
+        }
+        continue;
+      }
+      mIdle.store(true, std::memory_order_relaxed);
+      if (mQueue.empty()) {
+        mWake.wait_for(lock, pollInterval());
+      }
+      mIdle.store(false, std::memory_order_relaxed);
+    }
+  }
+};
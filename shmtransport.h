@@ -0,0 +1,337 @@
+#pragma once
+#include "test.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+// Shared memory transport stand-in: message buffers live in a segment (memfd or POSIX shm) mapped by every
+// process on the host that talks to it. Between processes only a ShmHandle (segment + offset) travels, the receiver
+// turns it back into a message pointing to the same pages, so nothing is ever copied.
+
+//__________________________________________________________________________________________________
+/// What is sent to another process instead of the message: where the buffer is. A handle carries one reference to
+/// the buffer, it has to be turned back into a message (ShmTransportFactory::CreateMessage()) exactly once.
+struct ShmHandle {
+  uint64_t segment{ 0 }; // id of the segment, 0 is never a valid one
+  uint64_t offset{ 0 };  // of the buffer from the start of the segment
+  uint64_t size{ 0 };    // used bytes of the buffer
+};
+
+namespace internal {
+// size classes of the segment allocator: smallest, 2x smallest, ...
+constexpr size_t shmSizeClasses = 40;
+constexpr size_t shmSmallestBlock = 64;
+
+//__________________________________________________________________________________________________
+/// A mapped segment and its allocator. All bookkeeping lives at the start of the segment itself so every process
+/// mapping it shares it: buffers come in power of two size classes from a bump pointer and are recycled through one
+/// free list per class. Everything refers to offsets, every process maps the segment at a different address.
+/// Within a process the mapping is reference counted: the factory holds one reference and every message over the
+/// segment another, the last one unmaps it, so messages may outlive their factory.
+class ShmSegment {
+  struct Header {
+    uint64_t magic;
+    uint64_t id;
+    uint64_t size;
+    SpinLock lock;
+    uint64_t top;                       // first byte never handed out
+    uint64_t freeLists[shmSizeClasses]; // first free block of each size class, 0: none
+    uint64_t usedBytes;
+  };
+  // in front of every buffer
+  struct Block {
+    uint32_t magic;
+    uint32_t sizeClass;
+    std::atomic<uint32_t> refs;
+    uint32_t reserved;
+  };
+
+public:
+  /// map the segment behind fd (owned from now on), initializing it if create is set
+  ShmSegment(int fd, size_t size, bool create) : mFd{ fd }
+  {
+    struct stat info;
+    if (create ? size < sizeof(Header) || ftruncate(mFd, size) != 0
+               : fstat(mFd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header)) {
+      close(mFd);
+      throw std::runtime_error("ShmSegment: cannot use the segment");
+    }
+    if (!create) {
+      size = info.st_size;
+    }
+    void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, 0);
+    if (base == MAP_FAILED) {
+      close(mFd);
+      throw std::bad_alloc();
+    }
+    mBase = static_cast<byte*>(base);
+    mHeader = static_cast<Header*>(base);
+    if (create) {
+      new (mHeader) Header{};
+      mHeader->id = newId();
+      mHeader->size = size;
+      mHeader->top = (sizeof(Header) + 63) / 64 * 64;
+      mHeader->magic = magicValue();
+    }
+    else if (mHeader->magic != magicValue()) {
+      munmap(mBase, size);
+      close(mFd);
+      throw std::runtime_error("ShmSegment: not a segment");
+    }
+  }
+  ShmSegment(const ShmSegment&) = delete;
+  ShmSegment& operator=(const ShmSegment&) = delete;
+
+  /// one more process local reference to the mapping, a new segment comes with one
+  void refMapping() noexcept { mMappingRefs.fetch_add(1, std::memory_order_relaxed); }
+  /// drop a reference to the mapping, the last one unmaps the segment and deletes it
+  static void unrefMapping(ShmSegment* segment) noexcept
+  {
+    if (segment->mMappingRefs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete segment;
+    }
+  }
+
+  int fd() const noexcept { return mFd; }
+  uint64_t id() const noexcept { return mHeader->id; }
+  size_t size() const noexcept { return mHeader->size; }
+  size_t usedBytes() const
+  {
+    std::lock_guard<SpinLock> guard(mHeader->lock);
+    return mHeader->usedBytes;
+  }
+
+  /// a buffer of at least bytes with one reference, nullptr if the segment is exhausted
+  void* allocate(size_t bytes)
+  {
+    size_t sizeClass = 0;
+    while ((shmSmallestBlock << sizeClass) < bytes) {
+      if (++sizeClass == shmSizeClasses) {
+        return nullptr;
+      }
+    }
+    size_t capacity = shmSmallestBlock << sizeClass;
+    uint64_t offset = 0;
+    {
+      std::lock_guard<SpinLock> guard(mHeader->lock);
+      offset = mHeader->freeLists[sizeClass];
+      if (offset) {
+        std::memcpy(&mHeader->freeLists[sizeClass], mBase + offset, sizeof(uint64_t));
+      }
+      else {
+        if (mHeader->top + sizeof(Block) + capacity > mHeader->size) {
+          return nullptr;
+        }
+        offset = mHeader->top + sizeof(Block);
+        mHeader->top = offset + capacity;
+      }
+      mHeader->usedBytes += capacity;
+    }
+    Block* header = block(offset);
+    header->magic = blockMagic();
+    header->sizeClass = sizeClass;
+    header->refs.store(1, std::memory_order_relaxed);
+    return mBase + offset;
+  }
+
+  /// offset of a buffer handed out by allocate(), throws if data is anything else
+  uint64_t offsetOf(const void* data) const
+  {
+    auto p = static_cast<const byte*>(data);
+    if (p < mBase + sizeof(Header) + sizeof(Block) || p >= mBase + mHeader->size) {
+      throw std::runtime_error("ShmSegment: buffer is not in the segment");
+    }
+    uint64_t offset = p - mBase;
+    const Block* header = block(offset);
+    if (header->magic != blockMagic() || header->sizeClass >= shmSizeClasses) {
+      throw std::runtime_error("ShmSegment: not the start of a buffer");
+    }
+    return offset;
+  }
+  void* data(uint64_t offset) const { return mBase + offsetOf(mBase + offset); }
+
+  void ref(uint64_t offset) noexcept { block(offset)->refs.fetch_add(1, std::memory_order_relaxed); }
+  void unref(uint64_t offset) noexcept
+  {
+    Block* header = block(offset);
+    if (header->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+      return;
+    }
+    std::lock_guard<SpinLock> guard(mHeader->lock);
+    std::memcpy(mBase + offset, &mHeader->freeLists[header->sizeClass], sizeof(uint64_t));
+    mHeader->freeLists[header->sizeClass] = offset;
+    mHeader->usedBytes -= shmSmallestBlock << header->sizeClass;
+  }
+
+private:
+  int mFd{ -1 };
+  byte* mBase{ nullptr };
+  Header* mHeader{ nullptr };
+  std::atomic<size_t> mMappingRefs{ 1 };
+
+  ~ShmSegment()
+  {
+    munmap(mBase, mHeader->size);
+    close(mFd);
+  }
+
+  static constexpr uint64_t magicValue() { return UINT64_C(0x4f32534547000001); }
+  static constexpr uint32_t blockMagic() { return 0x4f32424b; }
+
+  Block* block(uint64_t offset) const noexcept { return reinterpret_cast<Block*>(mBase + offset - sizeof(Block)); }
+
+  static uint64_t newId() noexcept
+  {
+    static std::atomic<uint64_t> counter{ 0 };
+    uint64_t id = (static_cast<uint64_t>(getpid()) << 40) ^ (++counter << 20) ^
+                  static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+    return id ? id : 1;
+  }
+};
+}
+
+//__________________________________________________________________________________________________
+/// Transport whose messages live in a shared memory segment. Messages go to another process as ShmHandles
+/// (ReleaseMessage()/CreateMessage(handle)), the other side maps the same segment, either inheriting the file
+/// descriptor (Attach()) or by name. Buffers of other transports cannot be adopted, getMessage() copies them into
+/// the segment. The memory policy does not apply, the segment is the backing. The messages keep the segment mapped,
+/// they may outlive the factory.
+class ShmTransportFactory : public FairMQTransportFactory {
+public:
+  /// create an anonymous segment (memfd) of segmentSize bytes, other processes attach to its file descriptor
+  explicit ShmTransportFactory(size_t segmentSize = size_t{ 256 } << 20)
+  {
+    int fd = -1;
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("fakemq-shm", MFD_CLOEXEC);
+#endif
+    if (fd < 0) {
+      // no memfd: an unlinked POSIX shm object does the same
+      std::string name = "/fakemq-shm-" + std::to_string(getpid()) + "-" + std::to_string(reinterpret_cast<uintptr_t>(this));
+      fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+      shm_unlink(name.c_str());
+    }
+    if (fd < 0) {
+      throw std::runtime_error("ShmTransportFactory: cannot create a segment");
+    }
+    mSegment = new internal::ShmSegment(fd, segmentSize, true);
+  }
+  /// create (segmentSize > 0) or open (segmentSize == 0) the named POSIX shm segment, the creator removes the
+  /// name again when it is destroyed
+  ShmTransportFactory(const std::string& name, size_t segmentSize) : mName{ segmentSize ? name : std::string() }
+  {
+    int fd = shm_open(name.c_str(), segmentSize ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("ShmTransportFactory: cannot open segment " + name);
+    }
+    mSegment = new internal::ShmSegment(fd, segmentSize, segmentSize > 0);
+  }
+  ShmTransportFactory(const ShmTransportFactory&) = delete;
+  ShmTransportFactory& operator=(const ShmTransportFactory&) = delete;
+  ~ShmTransportFactory() override
+  {
+    if (!mName.empty()) {
+      shm_unlink(mName.c_str());
+    }
+    internal::ShmSegment::unrefMapping(mSegment);
+  }
+
+  /// map the segment behind the (e.g. inherited) file descriptor, the caller keeps its descriptor
+  static std::unique_ptr<ShmTransportFactory> Attach(int fd)
+  {
+    int own = dup(fd);
+    if (own < 0) {
+      throw std::runtime_error("ShmTransportFactory: bad segment file descriptor");
+    }
+    return std::unique_ptr<ShmTransportFactory>{ new ShmTransportFactory(own, attachTag{}) };
+  }
+
+  int GetSegmentFd() const noexcept { return mSegment->fd(); }
+  uint64_t GetSegmentId() const noexcept { return mSegment->id(); }
+  size_t GetSegmentSize() const noexcept { return mSegment->size(); }
+  /// bytes handed out (rounded up to the size classes) by all processes
+  size_t GetUsedBytes() const { return mSegment->usedBytes(); }
+
+  /// only buffers in the same segment
+  bool CanAdopt(const FairMQTransportFactory* origin) const noexcept override
+  {
+    auto shm = dynamic_cast<const ShmTransportFactory*>(origin);
+    return shm && shm->GetSegmentId() == GetSegmentId();
+  }
+
+  using FairMQTransportFactory::CreateMessage;
+  using FairMQTransportFactory::CreateMessages;
+
+  FairMQMessagePtr CreateMessage(const size_t size, const MemoryPolicy& /*policy*/) const override
+  {
+    void* data = mSegment->allocate(size);
+    if (!data) {
+      throw std::bad_alloc();
+    }
+    return adopt(data, size);
+  }
+  /// one buffer per part, every part has to be sendable on its own
+  std::vector<FairMQMessagePtr> CreateMessages(const size_t* sizes, size_t n, const MemoryPolicy& policy,
+                                               size_t /*alignment*/ = alignof(std::max_align_t)) const override
+  {
+    std::vector<FairMQMessagePtr> messages;
+    messages.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+      messages.push_back(CreateMessage(sizes[i], policy));
+    }
+    return messages;
+  }
+
+  /// the message the handle refers to, taking over the reference the handle carries
+  FairMQMessagePtr CreateMessage(const ShmHandle& handle) const
+  {
+    if (handle.segment != GetSegmentId()) {
+      throw std::runtime_error("ShmTransportFactory: handle of another segment");
+    }
+    void* data = mSegment->data(handle.offset);
+    return adopt(data, handle.size);
+  }
+
+  /// turn a message with a buffer in the segment into a handle for another process (or this one), the buffer
+  /// stays alive until the handle is turned back into a message and that one dies
+  ShmHandle ReleaseMessage(FairMQMessagePtr message) const
+  {
+    ShmHandle handle{ GetSegmentId(), mSegment->offsetOf(message->GetData()), message->GetUsedSize() };
+    mSegment->ref(handle.offset);
+    return handle;
+  }
+
+private:
+  struct attachTag {
+  };
+
+  internal::ShmSegment* mSegment{ nullptr }; // one reference to the mapping
+  std::string mName;
+
+  ShmTransportFactory(int fd, attachTag) : mSegment{ new internal::ShmSegment(fd, 0, false) } {}
+
+  // a message over the buffer at data, holding one reference to the mapping
+  FairMQMessagePtr adopt(void* data, size_t size) const
+  {
+    auto message = std::make_unique<FairMQMessage>(data, size, &release, mSegment);
+    mSegment->refMapping();
+    return message;
+  }
+
+  // free function of the messages, the hint is the segment
+  static void release(void* data, void* hint)
+  {
+    auto segment = static_cast<internal::ShmSegment*>(hint);
+    segment->unref(segment->offsetOf(data));
+    internal::ShmSegment::unrefMapping(segment);
+  }
+};
@@ -1,16 +1,148 @@
+#pragma once
+#include "bulkcopy.h"
 #include "fake.h"
-#include <boost/container/flat_map.hpp>
 #include <boost/container/pmr/memory_resource.hpp>
 #include <boost/container/pmr/monotonic_buffer_resource.hpp>
 #include <boost/container/pmr/polymorphic_allocator.hpp>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <iterator>
+#include <memory>
+#include <mutex>
 #include <new>
+#include <stdexcept>
+#include <thread>
 #include <type_traits>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
+namespace internal {
+constexpr size_t statsHistogramBins = 64;
+}
+
+//__________________________________________________________________________________________________
+/// What went through a FairMQMemoryResource, see FairMQMemoryResource::getResourceStats(). Sizes in bytes,
+/// histogram bin i counts the values in [2^(i-1), 2^i), bin 0 the zeros. All zero unless FAKEMQ_ENABLE_STATS.
+struct ResourceStatsSnapshot {
+  uint64_t allocations{ 0 };    // buffers allocated (or registered with setMessage())
+  uint64_t deallocations{ 0 };  // buffers deallocated
+  uint64_t handedOut{ 0 };      // buffers that left as a message with getMessage()
+  uint64_t allocatedBytes{ 0 };
+  uint64_t releasedBytes{ 0 };  // deallocated or handed out
+  uint64_t liveBytes{ 0 };
+  uint64_t peakLiveBytes{ 0 };
+  uint64_t adoptions{ 0 };      // messages adopted by containers or views on top of this resource
+  uint64_t copyFallbacks{ 0 };  // getMessage() hand overs to this resource that had to copy
+  uint64_t copiedBytes{ 0 };
+  uint64_t badAllocs{ 0 };      // adoptions or allocations larger than the buffer
+  uint64_t sizes[internal::statsHistogramBins]{};     // allocation sizes
+  uint64_t lifetimes[internal::statsHistogramBins]{}; // nanoseconds from allocation to deallocation or hand out
+};
+
+namespace internal {
+inline unsigned log2Bin(uint64_t value) noexcept
+{
+  return value ? std::min(63u, static_cast<unsigned>(64 - __builtin_clzll(value))) : 0u;
+}
+
+/// nanoseconds, the time base of the lifetime histograms
+inline uint64_t statsClock() noexcept
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+    .count();
+}
+
+//__________________________________________________________________________________________________
+/// The counters behind ResourceStatsSnapshot: relaxed atomics only, a snapshot is not a consistent cut.
+class ResourceStats {
+  using Counter = std::atomic<uint64_t>;
+
+public:
+  void allocated(size_t bytes) noexcept
+  {
+    add(mAllocations);
+    add(mAllocatedBytes, bytes);
+    add(mSizes[log2Bin(bytes)]);
+    uint64_t live = mLiveBytes.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    uint64_t peak = mPeakLiveBytes.load(std::memory_order_relaxed);
+    while (live > peak && !mPeakLiveBytes.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+  }
+  /// born is the statsClock() of the allocation, 0 if unknown
+  void released(size_t bytes, uint64_t born, bool handedOut) noexcept
+  {
+    add(handedOut ? mHandedOut : mDeallocations);
+    add(mReleasedBytes, bytes);
+    mLiveBytes.fetch_sub(bytes, std::memory_order_relaxed);
+    if (born) {
+      add(mLifetimes[log2Bin(statsClock() - born)]);
+    }
+  }
+  void adopted() noexcept { add(mAdoptions); }
+  void copied(size_t bytes) noexcept
+  {
+    add(mCopyFallbacks);
+    add(mCopiedBytes, bytes);
+  }
+  void badAlloc() noexcept { add(mBadAllocs); }
+
+  ResourceStatsSnapshot snapshot() const noexcept
+  {
+    ResourceStatsSnapshot s;
+    s.allocations = load(mAllocations);
+    s.deallocations = load(mDeallocations);
+    s.handedOut = load(mHandedOut);
+    s.allocatedBytes = load(mAllocatedBytes);
+    s.releasedBytes = load(mReleasedBytes);
+    s.liveBytes = load(mLiveBytes);
+    s.peakLiveBytes = load(mPeakLiveBytes);
+    s.adoptions = load(mAdoptions);
+    s.copyFallbacks = load(mCopyFallbacks);
+    s.copiedBytes = load(mCopiedBytes);
+    s.badAllocs = load(mBadAllocs);
+    for (size_t i = 0; i < internal::statsHistogramBins; ++i) {
+      s.sizes[i] = load(mSizes[i]);
+      s.lifetimes[i] = load(mLifetimes[i]);
+    }
+    return s;
+  }
+
+private:
+  Counter mAllocations{ 0 };
+  Counter mDeallocations{ 0 };
+  Counter mHandedOut{ 0 };
+  Counter mAllocatedBytes{ 0 };
+  Counter mReleasedBytes{ 0 };
+  Counter mLiveBytes{ 0 };
+  Counter mPeakLiveBytes{ 0 };
+  Counter mAdoptions{ 0 };
+  Counter mCopyFallbacks{ 0 };
+  Counter mCopiedBytes{ 0 };
+  Counter mBadAllocs{ 0 };
+  Counter mSizes[internal::statsHistogramBins]{};
+  Counter mLifetimes[internal::statsHistogramBins]{};
+
+  static void add(Counter& counter, uint64_t n = 1) noexcept { counter.fetch_add(n, std::memory_order_relaxed); }
+  static uint64_t load(const Counter& counter) noexcept { return counter.load(std::memory_order_relaxed); }
+};
+}
+
+//__________________________________________________________________________________________________
+/// Destroys the messages a FairMQMemoryResource lets go of, instead of the thread deallocating the buffer
+/// (see FairMQMemoryResource::setReclaimer() and BackgroundReclaimer).
+class MessageReclaimer {
+public:
+  virtual ~MessageReclaimer() = default;
+  virtual void retire(FairMQMessagePtr message) noexcept = 0;
+};
+
 //__________________________________________________________________________________________________
 /// All FairMQ related memory resources need to inherit from this interface class for the getMessage() api.
 class FairMQMemoryResource : public boost::container::pmr::memory_resource {
@@ -22,18 +154,281 @@ public:
   virtual void* setMessage(FairMQMessagePtr) = 0;
   virtual const FairMQTransportFactory* getTransportFactory() const noexcept = 0;
   virtual size_t getNumberOfMessages() const noexcept = 0;
+
+  /// allocate n buffers of the given sizes in one call, the addresses are written to buffers. Every buffer is
+  /// deallocated (or turned into a message) on its own as usual. The default allocates them one by one,
+  /// resources backed by a transport carve them from one region.
+  virtual void allocateBatch(const size_t* sizes, size_t n, void** buffers,
+                             size_t alignment = alignof(std::max_align_t))
+  {
+    for (size_t i = 0; i < n; ++i) {
+      buffers[i] = allocate(sizes[i], alignment);
+    }
+  }
+  /// append the messages of n buffers to parts, in order, as n getMessage() calls would
+  virtual void getMessages(void* const* buffers, size_t n, FairMQParts& parts)
+  {
+    parts.fParts.reserve(parts.fParts.size() + n);
+    for (size_t i = 0; i < n; ++i) {
+      parts.AddPart(getMessage(buffers[i]));
+    }
+  }
+
+  /// destroy a message given up by this resource (or by a container adopting one of its messages): right here,
+  /// or on the reclaimer's thread if one is set
+  void releaseMessage(FairMQMessagePtr message) noexcept
+  {
+    if (mReclaimer && message) {
+      mReclaimer->retire(std::move(message));
+    }
+  }
+  /// defer the destruction of the messages given up by deallocate(), nullptr to free them on the deallocating
+  /// thread again. To be set before buffers are handed out, the reclaimer has to outlive all of them.
+  void setReclaimer(MessageReclaimer* reclaimer) noexcept { mReclaimer = reclaimer; }
+  MessageReclaimer* getReclaimer() const noexcept { return mReclaimer; }
+
+  ResourceStatsSnapshot getResourceStats() const noexcept
+  {
+#if FAKEMQ_ENABLE_STATS
+    return mStats.snapshot();
+#else
+    return ResourceStatsSnapshot{};
+#endif
+  }
+#if FAKEMQ_ENABLE_STATS
+  internal::ResourceStats& resourceStats() noexcept { return mStats; }
+#endif
+
+protected:
+  MessageReclaimer* mReclaimer{ nullptr };
+#if FAKEMQ_ENABLE_STATS
+  internal::ResourceStats mStats;
+#endif
+};
+
+//__________________________________________________________________________________________________
+/// Minimal test-and-test-and-set lock for short critical sections that are almost never contended.
+/// Usable with std::lock_guard.
+class SpinLock {
+  std::atomic<bool> mLocked{ false };
+
+public:
+  void lock() noexcept
+  {
+    while (mLocked.exchange(true, std::memory_order_acquire)) {
+      for (unsigned spins = 0; mLocked.load(std::memory_order_relaxed); ++spins) {
+        if (spins > 64) {
+          std::this_thread::yield();
+        }
+      }
+    }
+  }
+  bool try_lock() noexcept { return !mLocked.exchange(true, std::memory_order_acquire); }
+  void unlock() noexcept { mLocked.store(false, std::memory_order_release); }
+};
+
+//__________________________________________________________________________________________________
+/// Registry of the messages owned by a resource, keyed by the data pointer.
+/// Open addressing with linear probing and backward shift deletion, so insert, lookup and erase are O(1)
+/// on average and no node is allocated per message. The table is kept at most half full. The empty key marks free
+/// slots, so a message registered at nullptr (a buffer-less empty message) is kept aside in a slot of its own.
+class MessageRegistry {
+  struct Slot {
+    void* key{ nullptr };
+    FairMQMessagePtr message{ nullptr };
+#if FAKEMQ_ENABLE_STATS
+    uint64_t born{ 0 }; // statsClock() of the insertion
+#endif
+  };
+
+public:
+  MessageRegistry() = default;
+  MessageRegistry(const MessageRegistry&) = delete;
+  MessageRegistry& operator=(const MessageRegistry&) = delete;
+  MessageRegistry(MessageRegistry&&) noexcept = default;
+  MessageRegistry& operator=(MessageRegistry&&) noexcept = default;
+
+  size_t size() const noexcept { return mSize; }
+  size_t capacity() const noexcept { return mSlots.size(); }
+
+  /// make room for n messages without rehashing
+  void reserve(size_t n)
+  {
+    size_t wanted = 16;
+    while (wanted < 2 * n) {
+      wanted *= 2;
+    }
+    if (wanted > mSlots.size()) {
+      rehash(wanted);
+    }
+  }
+
+  /// take ownership of the message stored at key, an already registered message at the same key is replaced
+  void insert(void* key, FairMQMessagePtr message)
+  {
+    if (!key) {
+      if (!mHasNull) {
+        mHasNull = true;
+        ++mSize;
+      }
+      mNullSlot.message = std::move(message);
+      FAKEMQ_STATS(mNullSlot.born = internal::statsClock());
+      return;
+    }
+    if (2 * (mSize + 1) > mSlots.size()) {
+      rehash(mSlots.empty() ? 16 : 2 * mSlots.size());
+    }
+    size_t i = bucket(key);
+    while (mSlots[i].key) {
+      if (mSlots[i].key == key) {
+        break;
+      }
+      i = (i + 1) & mMask;
+    }
+    if (!mSlots[i].key) {
+      mSlots[i].key = key;
+      ++mSize;
+    }
+    mSlots[i].message = std::move(message);
+    FAKEMQ_STATS(mSlots[i].born = internal::statsClock());
+  }
+
+  /// give up ownership of the message at key, nullptr if there is none. born (optional) receives the time of
+  /// the insertion if the stats are enabled, 0 otherwise.
+  FairMQMessagePtr extract(void* key, uint64_t* born = nullptr) noexcept
+  {
+    size_t i = find(key);
+    if (i == npos) {
+      return nullptr;
+    }
+    Slot& slot = i == nullIndex ? mNullSlot : mSlots[i];
+    if (born) {
+#if FAKEMQ_ENABLE_STATS
+      *born = slot.born;
+#else
+      *born = 0;
+#endif
+    }
+    auto message = std::move(slot.message);
+    remove(i);
+    return message;
+  }
+
+  /// destroy the message at key, returns false if it was not registered
+  bool erase(void* key) noexcept
+  {
+    size_t i = find(key);
+    if (i == npos) {
+      return false;
+    }
+    // the message dies only after the slot is gone, its destructor may call back into the owner
+    auto message = std::move(i == nullIndex ? mNullSlot.message : mSlots[i].message);
+    remove(i);
+    return true;
+  }
+
+  bool contains(void* key) const noexcept { return find(key) != npos; }
+
+private:
+  static constexpr size_t npos = static_cast<size_t>(-1);
+
+  static constexpr size_t nullIndex = npos - 1; // find() of nullptr, the index of mNullSlot
+
+  std::vector<Slot> mSlots{};
+  Slot mNullSlot{};
+  bool mHasNull{ false };
+  size_t mSize{ 0 };
+  size_t mMask{ 0 };
+  unsigned mShift{ 64 };
+
+  size_t bucket(const void* key) const noexcept
+  {
+    // fibonacci hashing, the low bits of buffer addresses carry no information (alignment)
+    return static_cast<size_t>((reinterpret_cast<uintptr_t>(key) * UINT64_C(0x9E3779B97F4A7C15)) >> mShift);
+  }
+
+  size_t find(const void* key) const noexcept
+  {
+    if (!key) {
+      return mHasNull ? nullIndex : npos;
+    }
+    if (mSlots.empty()) {
+      return npos;
+    }
+    for (size_t i = bucket(key);; i = (i + 1) & mMask) {
+      if (mSlots[i].key == key) {
+        return i;
+      }
+      if (!mSlots[i].key) {
+        return npos;
+      }
+    }
+  }
+
+  // backward shift deletion: pull following entries of the probe sequence into the hole, no tombstones needed
+  void remove(size_t hole) noexcept
+  {
+    if (hole == nullIndex) {
+      mNullSlot.message = nullptr;
+      mHasNull = false;
+      --mSize;
+      return;
+    }
+    for (size_t i = (hole + 1) & mMask; mSlots[i].key; i = (i + 1) & mMask) {
+      size_t home = bucket(mSlots[i].key);
+      if (((i - home) & mMask) >= ((i - hole) & mMask)) {
+        mSlots[hole] = std::move(mSlots[i]);
+        hole = i;
+      }
+    }
+    mSlots[hole].key = nullptr;
+    mSlots[hole].message = nullptr;
+    --mSize;
+  }
+
+  void rehash(size_t newCapacity)
+  {
+    std::vector<Slot> old;
+    old.swap(mSlots);
+    mSlots.resize(newCapacity);
+    mMask = newCapacity - 1;
+    mShift = 64;
+    for (size_t c = newCapacity; c > 1; c >>= 1) {
+      --mShift;
+    }
+    for (auto& slot : old) {
+      if (slot.key) {
+        size_t i = bucket(slot.key);
+        while (mSlots[i].key) {
+          i = (i + 1) & mMask;
+        }
+        mSlots[i] = std::move(slot);
+      }
+    }
+  }
 };
 
 //__________________________________________________________________________________________________
 /// This is the allocator that interfaces to FairMQ memory management. All allocations are delegated
 /// to FairMQ so standard (e.g. STL) containers can construct their stuff in memory regions appropriate
 /// for the data channel configuration.
+/// A resource is meant to be used by one thread (see getTransportAllocator()), but buffers may be handed to
+/// other threads: getMessage()/deallocate() from any thread are safe, the registry lock is only ever
+/// contended during such a handoff.
 class ChannelResource : public FairMQMemoryResource {
 protected:
   const FairMQTransportFactory* factory{ nullptr };
-  // TODO: for now a map to keep track of allocations, something else would probably be faster, but for now this does
-  // not need to be fast.
-  boost::container::flat_map<void*, FairMQMessagePtr> messageMap;
+  // keeps track of allocations, O(1) in the number of live messages
+  MessageRegistry messageMap;
+  mutable SpinLock mLock;
+  // backing of the allocated buffers if it differs from the transport default
+  bool mHasPolicy{ false };
+  MemoryPolicy mPolicy{};
+
+  FairMQMessagePtr createMessage(size_t bytes) const
+  {
+    return mHasPolicy ? factory->CreateMessage(bytes, mPolicy) : factory->CreateMessage(bytes);
+  }
 
 public:
   ChannelResource() = delete;
@@ -43,30 +438,89 @@ public:
       throw std::runtime_error("Tried to construct from a nullptr FairMQTransportFactory");
     }
   };
-  FairMQMessagePtr getMessage(void* p) override { auto mes = std::move(messageMap[p]); messageMap.erase(p); return mes;}
+  /// allocate with a backing (e.g. huge pages, NUMA placement) different from the transport default
+  ChannelResource(const FairMQTransportFactory* _factory, MemoryPolicy policy) : ChannelResource(_factory)
+  {
+    mHasPolicy = true;
+    mPolicy = policy;
+  }
+  FairMQMessagePtr getMessage(void* p) override
+  {
+    uint64_t born = 0;
+    FairMQMessagePtr message;
+    {
+      std::lock_guard<SpinLock> guard(mLock);
+      message = messageMap.extract(p, &born);
+    }
+    FAKEMQ_STATS(if (message) { mStats.released(message->GetSize(), born, true); });
+    return message;
+  }
   void* setMessage(FairMQMessagePtr message) override
   {
     void* addr = message->GetData();
-    messageMap[addr] = std::move(message);
+    FAKEMQ_STATS(mStats.allocated(message->GetSize()));
+    std::lock_guard<SpinLock> guard(mLock);
+    messageMap.insert(addr, std::move(message));
     return addr;
   }
   const FairMQTransportFactory* getTransportFactory() const noexcept override { return factory; }
 
-  size_t getNumberOfMessages() const noexcept override { return messageMap.size(); }
+  size_t getNumberOfMessages() const noexcept override
+  {
+    std::lock_guard<SpinLock> guard(mLock);
+    return messageMap.size();
+  }
+
+  /// one transport allocation for all buffers (see FairMQTransportFactory::CreateMessages()), registered in one go
+  void allocateBatch(const size_t* sizes, size_t n, void** buffers,
+                     size_t alignment = alignof(std::max_align_t)) override
+  {
+    auto messages = mHasPolicy ? factory->CreateMessages(sizes, n, mPolicy, alignment)
+                               : factory->CreateMessages(sizes, n, alignment);
+    std::lock_guard<SpinLock> guard(mLock);
+    messageMap.reserve(messageMap.size() + n);
+    for (size_t i = 0; i < n; ++i) {
+      buffers[i] = messages[i]->GetData();
+      FAKEMQ_STATS(mStats.allocated(messages[i]->GetSize()));
+      messageMap.insert(buffers[i], std::move(messages[i]));
+    }
+  }
+  void getMessages(void* const* buffers, size_t n, FairMQParts& parts) override
+  {
+    auto first = parts.fParts.size();
+    parts.fParts.resize(first + n);
+    std::lock_guard<SpinLock> guard(mLock);
+    for (size_t i = 0; i < n; ++i) {
+      uint64_t born = 0;
+      auto& message = parts.fParts[first + i];
+      message = messageMap.extract(buffers[i], &born);
+      FAKEMQ_STATS(if (message) { mStats.released(message->GetSize(), born, true); });
+    }
+  }
 
 protected:
   void* do_allocate(std::size_t bytes, std::size_t alignment) override
   {
     FairMQMessagePtr message;
-    message = factory->CreateMessage(bytes);
+    message = createMessage(bytes);
     void* addr = message->GetData();
-    messageMap[addr] = std::move(message);
+    FAKEMQ_STATS(mStats.allocated(message->GetSize()));
+    std::lock_guard<SpinLock> guard(mLock);
+    messageMap.insert(addr, std::move(message));
     return addr;
   };
 
   void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
   {
-    messageMap.erase(p);
+    // destroy the message outside of the lock, or leave that to the reclaimer
+    uint64_t born = 0;
+    FairMQMessagePtr message;
+    {
+      std::lock_guard<SpinLock> guard(mLock);
+      message = messageMap.extract(p, &born);
+    }
+    FAKEMQ_STATS(if (message) { mStats.released(message->GetSize(), born, false); });
+    releaseMessage(std::move(message));
     //if (1 > messageMap.erase(p)) {
     //  // so destructors should not throw, but deallocate maybe should?
     //  printf("ChannelResource::do_deallocate(%p)\n",p);
@@ -81,6 +535,257 @@ protected:
   };
 };
 
+//__________________________________________________________________________________________________
+/// Tuning knobs of the MessagePoolResource, sizes in bytes.
+struct MessagePoolOptions {
+  size_t smallestBlock{ 64 };           // size of the smallest size class, a power of two
+  size_t largestBlock{ 1 << 22 };       // larger requests are not pooled, a power of two >= smallestBlock
+  size_t maxBlocksPerClass{ 64 };       // high-water mark of idle blocks kept per size class
+  size_t maxPooledBytes{ size_t{ 1 } << 28 }; // high-water mark of idle bytes kept over all classes
+};
+
+//__________________________________________________________________________________________________
+struct MessagePoolStats {
+  size_t hits{ 0 };        // allocations served from a free list
+  size_t misses{ 0 };      // allocations that had to create a new block
+  size_t unpooled{ 0 };    // allocations larger than the largest size class
+  size_t recycled{ 0 };    // blocks returned to a free list
+  size_t dropped{ 0 };     // blocks freed on return because a high-water mark was reached
+  size_t trimmed{ 0 };     // idle blocks freed by trim()/release()
+  size_t pooledBytes{ 0 }; // bytes currently idle in the free lists
+  double hitRate() const noexcept { return (hits + misses) ? static_cast<double>(hits) / (hits + misses) : 0.; }
+};
+
+//__________________________________________________________________________________________________
+/// A ChannelResource recycling the message buffers in power of two size classes.
+/// Every allocation hands out a message adopting a pooled backing buffer; its free function puts the buffer back
+/// in the free list, whether the message died in deallocate() or after being taken out with getMessage().
+/// The pool bookkeeping is reference counted by the outstanding buffers, so messages may outlive the resource.
+class MessagePoolResource : public ChannelResource {
+  struct State;
+
+  struct Block {
+    State* state;
+    FairMQMessagePtr backing;
+    size_t sizeClass;
+    Block* next;
+  };
+
+  struct SizeClass {
+    Block* free{ nullptr };
+    size_t count{ 0 };
+    bool used{ false };
+  };
+
+  struct State {
+    MessagePoolOptions options;
+    std::vector<SizeClass> classes;
+    SpinLock lock{};
+    std::atomic<size_t> refs{ 1 };
+    bool orphaned{ false };
+    MessagePoolStats stats{};
+
+    size_t blockSize(size_t sizeClass) const noexcept { return options.smallestBlock << sizeClass; }
+  };
+
+public:
+  static constexpr size_t unpooledClass = static_cast<size_t>(-1);
+
+  MessagePoolResource(const FairMQTransportFactory* _factory, MessagePoolOptions options = MessagePoolOptions{})
+    : MessagePoolResource(_factory, _factory ? _factory->GetMemoryPolicy() : MemoryPolicy{}, options)
+  {
+  }
+  MessagePoolResource(const FairMQTransportFactory* _factory, MemoryPolicy policy,
+                      MessagePoolOptions options = MessagePoolOptions{})
+    : ChannelResource(_factory, policy), mState{ new State{ validated(options), {} } }
+  {
+    size_t nClasses = 1;
+    while ((options.smallestBlock << (nClasses - 1)) < options.largestBlock) {
+      ++nClasses;
+    }
+    mState->classes.resize(nClasses);
+  }
+  MessagePoolResource(const MessagePoolResource&) = delete;
+  MessagePoolResource& operator=(const MessagePoolResource&) = delete;
+
+  ~MessagePoolResource()
+  {
+    Block* idle = nullptr;
+    {
+      std::lock_guard<SpinLock> guard(mState->lock);
+      mState->orphaned = true;
+      idle = collect(false);
+    }
+    destroy(idle);
+    unref(mState);
+  }
+
+  /// release the idle blocks of the size classes that were not allocated from since the previous trim(),
+  /// meant to be called periodically, e.g. when the processing loop is idle. Returns the number of bytes freed.
+  size_t trim()
+  {
+    Block* idle = nullptr;
+    {
+      std::lock_guard<SpinLock> guard(mState->lock);
+      idle = collect(true);
+    }
+    return destroy(idle);
+  }
+
+  /// release all idle blocks, returns the number of bytes freed
+  size_t release()
+  {
+    Block* idle = nullptr;
+    {
+      std::lock_guard<SpinLock> guard(mState->lock);
+      idle = collect(false);
+    }
+    return destroy(idle);
+  }
+
+  MessagePoolStats getStats() const
+  {
+    std::lock_guard<SpinLock> guard(mState->lock);
+    return mState->stats;
+  }
+
+  /// served block by block from the pool, carving a shared region would bypass it
+  void allocateBatch(const size_t* sizes, size_t n, void** buffers,
+                     size_t alignment = alignof(std::max_align_t)) override
+  {
+    FairMQMemoryResource::allocateBatch(sizes, n, buffers, alignment);
+  }
+
+  /// index of the size class serving the request, unpooledClass if it is too large to be pooled
+  /// the options if they describe a sane ladder of size classes, throws std::invalid_argument otherwise
+  static const MessagePoolOptions& validated(const MessagePoolOptions& options)
+  {
+    auto isPowerOfTwo = [](size_t n) { return n && !(n & (n - 1)); };
+    if (!isPowerOfTwo(options.smallestBlock) || !isPowerOfTwo(options.largestBlock) ||
+        options.smallestBlock > options.largestBlock) {
+      throw std::invalid_argument("MessagePoolOptions: smallestBlock and largestBlock must be powers of two, "
+                                  "smallestBlock <= largestBlock");
+    }
+    return options;
+  }
+
+  size_t sizeClass(size_t bytes) const noexcept
+  {
+    // stop at the largest class: the shift must not wrap around for huge requests
+    const size_t nClasses = mState->classes.size();
+    size_t index = 0;
+    for (size_t blockSize = mState->options.smallestBlock; blockSize < bytes && index < nClasses; blockSize <<= 1) {
+      ++index;
+    }
+    return index < nClasses ? index : unpooledClass;
+  }
+
+protected:
+  State* mState{ nullptr };
+
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    size_t index = sizeClass(bytes);
+    Block* block = nullptr;
+    {
+      std::lock_guard<SpinLock> guard(mState->lock);
+      if (index == unpooledClass) {
+        ++mState->stats.unpooled;
+      }
+      else {
+        auto& entry = mState->classes[index];
+        entry.used = true;
+        if (entry.free) {
+          block = entry.free;
+          entry.free = block->next;
+          --entry.count;
+          mState->stats.pooledBytes -= mState->blockSize(index);
+          ++mState->stats.hits;
+        }
+        else {
+          ++mState->stats.misses;
+        }
+      }
+    }
+    if (index == unpooledClass) {
+      return ChannelResource::do_allocate(bytes, alignment);
+    }
+    if (!block) {
+      block = new Block{ mState, createMessage(mState->blockSize(index)), index, nullptr };
+      mState->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    return setMessage(factory->CreateMessage(block->backing->GetData(), bytes, &recycle, block));
+  }
+
+private:
+  // free function of the handed out messages
+  static void recycle(void* /*data*/, void* hint)
+  {
+    Block* block = static_cast<Block*>(hint);
+    State* state = block->state;
+    {
+      std::lock_guard<SpinLock> guard(state->lock);
+      auto& entry = state->classes[block->sizeClass];
+      size_t blockSize = state->blockSize(block->sizeClass);
+      if (!state->orphaned && entry.count < state->options.maxBlocksPerClass &&
+          state->stats.pooledBytes + blockSize <= state->options.maxPooledBytes) {
+        block->next = entry.free;
+        entry.free = block;
+        ++entry.count;
+        state->stats.pooledBytes += blockSize;
+        ++state->stats.recycled;
+        return;
+      }
+      ++state->stats.dropped;
+    }
+    delete block;
+    unref(state);
+  }
+
+  static void unref(State* state)
+  {
+    if (state->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete state;
+    }
+  }
+
+  // unlink the idle blocks (of the unused classes only if onlyUnused), to be called with the lock held
+  Block* collect(bool onlyUnused) noexcept
+  {
+    Block* idle = nullptr;
+    for (size_t index = 0; index < mState->classes.size(); ++index) {
+      auto& entry = mState->classes[index];
+      if (!onlyUnused || !entry.used) {
+        while (Block* block = entry.free) {
+          entry.free = block->next;
+          block->next = idle;
+          idle = block;
+          mState->stats.pooledBytes -= mState->blockSize(index);
+          ++mState->stats.trimmed;
+        }
+        entry.count = 0;
+      }
+      entry.used = false;
+    }
+    return idle;
+  }
+
+  // free a list of unlinked blocks outside of the lock
+  size_t destroy(Block* idle) noexcept
+  {
+    size_t bytes = 0;
+    while (idle) {
+      Block* block = idle;
+      idle = block->next;
+      bytes += block->backing->GetSize();
+      State* state = block->state;
+      delete block;
+      unref(state);
+    }
+    return bytes;
+  }
+};
+
 //__________________________________________________________________________________________________
 /// This memory resource only watches, does not allocate/deallocate anything.
 /// In combination with the ByteSpectatorAllocator this is an alternative to using span, as raw memory
@@ -102,8 +807,10 @@ protected:
   {
     if (message) {
       if (bytes > message->GetSize()) {
+        FAKEMQ_STATS(mStats.badAlloc());
         throw std::bad_alloc();
       }
+      FAKEMQ_STATS(mStats.adopted());
       return message->GetData();
     }
     else {
@@ -130,77 +837,224 @@ protected:
 
 //__________________________________________________________________________________________________
 /// This memory resource only watches, does not allocate/deallocate anything.
-/// Ownership is passed to the upstream resource.
-/// In combination with the SpectatorAllocator this is an alternative to using span, as raw memory
-/// (e.g. an existing buffer message) will be accessible with appropriate container.
+/// It holds the adopted message itself, the upstream resource only tells which transport it came from.
+/// In combination with the OwningMessageSpectatorAllocator this is an alternative to using span, as raw memory
+/// (e.g. an existing buffer message) will be accessible with appropriate container. It is the control block of
+/// one adoption: made on the heap by adoptVector(), deleted by the allocator when the container lets go of the
+/// buffer, so neither moving the container nor freeing the message touches the upstream resource.
 class MessageResource : public FairMQMemoryResource {
 
 public:
   MessageResource() noexcept = delete;
-  MessageResource(const MessageResource&) noexcept = default;
-  MessageResource(MessageResource&&) noexcept = default;
-  MessageResource& operator=(const MessageResource&) = default;
-  MessageResource& operator=(MessageResource&&) = default;
+  MessageResource(const MessageResource&) = delete;
+  MessageResource& operator=(const MessageResource&) = delete;
   MessageResource(FairMQMessagePtr message, FairMQMemoryResource* upstream)
-    : mUpstream{ upstream },
-      mMessageSize{ message->GetSize() },
-      mMessageData{ mUpstream ? mUpstream->setMessage(std::move(message))
-                              : throw std::runtime_error("MessageResource::MessageResource upstream is nullptr") }
+    : mUpstream{ upstream ? upstream : throw std::runtime_error("MessageResource::MessageResource upstream is nullptr") },
+      mMessage{ std::move(message) }
   {
   }
-  FairMQMessagePtr getMessage(void* p) override { return mUpstream->getMessage(p); }
+  ~MessageResource() { mUpstream->releaseMessage(std::move(mMessage)); }
+  FairMQMessagePtr getMessage(void* p) override
+  {
+    return mMessage && p == mMessage->GetData() ? std::move(mMessage) : nullptr;
+  }
   void* setMessage(FairMQMessagePtr message) override { return mUpstream->setMessage(std::move(message)); }
-  const FairMQTransportFactory* getTransportFactory() const noexcept override { return nullptr; }
-  size_t getNumberOfMessages() const noexcept override { return mMessageData ? 1 : 0; }
+  const FairMQTransportFactory* getTransportFactory() const noexcept override { return mUpstream->getTransportFactory(); }
+  size_t getNumberOfMessages() const noexcept override { return mMessage ? 1 : 0; }
+
+  /// give up the message, whatever the container does with the buffer afterwards
+  FairMQMessagePtr release() noexcept { return std::move(mMessage); }
+  FairMQMemoryResource* getUpstream() const noexcept { return mUpstream; }
 
 protected:
   FairMQMemoryResource* mUpstream{ nullptr };
-  size_t mMessageSize{ 0 };
-  void* mMessageData{ nullptr };
+  FairMQMessagePtr mMessage{ nullptr };
 
   virtual void* do_allocate(std::size_t bytes, std::size_t alignment) override
   {
-    if (bytes > mMessageSize) {
+    if (!mMessage || bytes > mMessage->GetSize()) {
+      FAKEMQ_STATS(mUpstream->resourceStats().badAlloc());
       throw std::bad_alloc();
     }
-    return mMessageData;
+    FAKEMQ_STATS(mUpstream->resourceStats().adopted());
+    return mMessage->GetData();
   }
   virtual void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override
   {
-    getMessage(mMessageData);//let the message die.
+    // let the message die, straight through its free function (on the reclaimer's thread if the upstream has one)
+    mUpstream->releaseMessage(std::move(mMessage));
     return;
   }
   virtual bool do_is_equal(const memory_resource& other) const noexcept override
   {
-    // since this uniquely owns the message it can never be equal to anybody else
-    return false;
+    // since this uniquely owns the message it is only equal to itself
+    return this == &other;
   }
 };
 
+namespace internal {
 //__________________________________________________________________________________________________
-// This in general (as in STL) is a bad idea, but here it is safe to inherit from an allocator since we
-// have no additional data and only override some methods so we don't get into slicing and other problems.
-template <typename T>
-class SpectatorAllocator : public boost::container::pmr::polymorphic_allocator<T> {
-public:
-  using boost::container::pmr::polymorphic_allocator<T>::polymorphic_allocator;
+/// control block of a SharedMessage
+struct SharedMessageBlock {
+  std::atomic<size_t> refs;
+  FairMQMessagePtr message;
+  const FairMQTransportFactory* factory;
+};
 
-  // skip default construction of empty elements
-  // this is important for two reasons: one: it allows us to adopt an existing buffer (e.g. incoming message) and
-  // quickly construct large vectors while skipping the element initialization.
-  template <class U>
-  void construct(U*)
-  {
+inline void unref(SharedMessageBlock* block) noexcept
+{
+  // the last owner can skip the read-modify-write: nobody else holds a reference that could be copied
+  if (block->refs.load(std::memory_order_acquire) == 1 || block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    delete block;
   }
+}
 
-  // dont try to call destructors, makes no sense since resource is managed externally AND allowed
-  // types cannot have side effects
-  template <typename U>
-  void destroy(U*)
+/// free function of the messages sharing a buffer, the hint is the control block
+inline void releaseSharedMessage(void* /*data*/, void* hint) { unref(static_cast<SharedMessageBlock*>(hint)); }
+}
+
+//__________________________________________________________________________________________________
+/// Reference counted, read-only handle to a message: copies share the buffer, which is freed with the last
+/// reference. share() makes as many outgoing messages of the same buffer as needed (fan-out without copies),
+/// each of them holds a reference as well. Nobody may write to the buffer once it is shared.
+class SharedMessage {
+public:
+  SharedMessage() noexcept = default;
+  /// factory (optional) is the transport of the message, share() makes messages of it by default
+  explicit SharedMessage(FairMQMessagePtr message, const FairMQTransportFactory* factory = nullptr)
+    : mBlock{ message ? new internal::SharedMessageBlock{ { 1 }, std::move(message), factory } : nullptr }
   {
   }
-
-  T* allocate(size_t size) { return reinterpret_cast<T*>(this->resource()->allocate(size * sizeof(T), 0)); }
+  SharedMessage(const SharedMessage& other) noexcept : mBlock{ other.mBlock } { ref(); }
+  SharedMessage(SharedMessage&& other) noexcept : mBlock{ other.mBlock } { other.mBlock = nullptr; }
+  SharedMessage& operator=(const SharedMessage& other) noexcept
+  {
+    SharedMessage copy(other);
+    std::swap(mBlock, copy.mBlock);
+    return *this;
+  }
+  SharedMessage& operator=(SharedMessage&& other) noexcept
+  {
+    std::swap(mBlock, other.mBlock);
+    return *this;
+  }
+  ~SharedMessage()
+  {
+    if (mBlock) {
+      internal::unref(mBlock);
+    }
+  }
+
+  explicit operator bool() const noexcept { return mBlock != nullptr; }
+  const void* data() const noexcept { return mBlock ? mBlock->message->GetData() : nullptr; }
+  /// the used bytes of the message
+  size_t size() const noexcept { return mBlock ? mBlock->message->GetUsedSize() : 0; }
+  /// the whole buffer
+  size_t capacity() const noexcept { return mBlock ? mBlock->message->GetSize() : 0; }
+  size_t useCount() const noexcept { return mBlock ? mBlock->refs.load(std::memory_order_relaxed) : 0; }
+  /// true if this is the only reference left. Unlike useCount() it synchronizes with the release of the others
+  /// (on any thread), so the buffer may be overwritten when it returns true.
+  bool unique() const noexcept { return mBlock && mBlock->refs.load(std::memory_order_acquire) == 1; }
+  const FairMQTransportFactory* getTransportFactory() const noexcept { return mBlock ? mBlock->factory : nullptr; }
+
+  /// a new message pointing to the buffer (made by factory, by default the one of the message), it keeps the
+  /// buffer alive until it dies
+  FairMQMessagePtr share(const FairMQTransportFactory* factory = nullptr) const { return share(0, size(), factory); }
+  /// same, for bytes of the buffer from offset on, e.g. one of several frames read into the buffer
+  FairMQMessagePtr share(size_t offset, size_t bytes, const FairMQTransportFactory* factory = nullptr) const
+  {
+    if (!mBlock) {
+      return nullptr;
+    }
+    if (offset > capacity() || bytes > capacity() - offset) {
+      throw std::out_of_range("SharedMessage::share: range is outside of the buffer");
+    }
+    factory = factory ? factory : mBlock->factory;
+    void* buffer = static_cast<byte*>(mBlock->message->GetData()) + offset;
+    ref();
+    return factory ? factory->CreateMessage(buffer, bytes, &internal::releaseSharedMessage, mBlock)
+                   : std::make_unique<FairMQMessage>(buffer, bytes, &internal::releaseSharedMessage, mBlock);
+  }
+
+private:
+  friend class SharedMessageResource;
+
+  internal::SharedMessageBlock* mBlock{ nullptr };
+
+  void ref() const noexcept
+  {
+    if (mBlock) {
+      mBlock->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+//__________________________________________________________________________________________________
+/// Read-only resource over a SharedMessage: every allocation (e.g. an adoptVector() view) holds a reference to the
+/// buffer, getMessage() makes a new outgoing message sharing it. Any number of views and messages can be made from
+/// one buffer, it is freed when the last of them and the resource are gone. The resource has to outlive the
+/// containers using it (as any resource), the messages do not depend on it.
+class SharedMessageResource : public FairMQMemoryResource {
+public:
+  explicit SharedMessageResource(SharedMessage message) noexcept : mMessage{ std::move(message) } {}
+  explicit SharedMessageResource(FairMQMessagePtr message, const FairMQTransportFactory* factory = nullptr)
+    : mMessage{ std::move(message), factory }
+  {
+  }
+
+  FairMQMessagePtr getMessage(void* p) override { return p && p == mMessage.data() ? mMessage.share() : nullptr; }
+  /// read only, nothing can be put here
+  void* setMessage(FairMQMessagePtr) override { return nullptr; }
+  const FairMQTransportFactory* getTransportFactory() const noexcept override { return mMessage.getTransportFactory(); }
+  size_t getNumberOfMessages() const noexcept override { return mMessage ? 1 : 0; }
+
+  const SharedMessage& getSharedMessage() const noexcept { return mMessage; }
+
+protected:
+  SharedMessage mMessage;
+
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    if (!mMessage || bytes > mMessage.capacity()) {
+      FAKEMQ_STATS(mStats.badAlloc());
+      throw std::bad_alloc();
+    }
+    FAKEMQ_STATS(mStats.adopted());
+    mMessage.ref();
+    return mMessage.mBlock->message->GetData();
+  }
+  void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override { internal::unref(mMessage.mBlock); }
+  bool do_is_equal(const memory_resource& other) const noexcept override
+  {
+    auto that = dynamic_cast<const SharedMessageResource*>(&other);
+    return that && that->mMessage.mBlock == mMessage.mBlock;
+  }
+};
+
+//__________________________________________________________________________________________________
+// This in general (as in STL) is a bad idea, but here it is safe to inherit from an allocator since we
+// have no additional data and only override some methods so we don't get into slicing and other problems.
+template <typename T>
+class SpectatorAllocator : public boost::container::pmr::polymorphic_allocator<T> {
+public:
+  using boost::container::pmr::polymorphic_allocator<T>::polymorphic_allocator;
+
+  // skip default construction of empty elements
+  // this is important for two reasons: one: it allows us to adopt an existing buffer (e.g. incoming message) and
+  // quickly construct large vectors while skipping the element initialization.
+  template <class U>
+  void construct(U*)
+  {
+  }
+
+  // dont try to call destructors, makes no sense since resource is managed externally AND allowed
+  // types cannot have side effects
+  template <typename U>
+  void destroy(U*)
+  {
+  }
+
+  T* allocate(size_t size) { return reinterpret_cast<T*>(this->resource()->allocate(size * sizeof(T), 0)); }
   void deallocate(T* ptr, size_t size)
   {
     this->resource()->deallocate(const_cast<typename std::remove_cv<T>::type*>(ptr), size);
@@ -208,35 +1062,48 @@ public:
 };
 
 //__________________________________________________________________________________________________
+/// One pointer wide: copies and moves of the allocator (and so of the container) only copy the pointer to the
+/// MessageResource of the adoption. The allocation owns that control block, deallocate() deletes it.
+/// A moved-from container is left with an empty allocator. Containers cannot be copied: only one owns the message.
 template <typename T>
 class OwningMessageSpectatorAllocator {
 public:
   using value_type = T;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
 
-  MessageResource mResource;
+  MessageResource* mResource{ nullptr };
 
   OwningMessageSpectatorAllocator() noexcept = default;
   OwningMessageSpectatorAllocator(const OwningMessageSpectatorAllocator&) noexcept = default;
-  OwningMessageSpectatorAllocator(OwningMessageSpectatorAllocator&&) noexcept = default;
-  OwningMessageSpectatorAllocator(MessageResource&& resource) noexcept : mResource{ resource } {}
+  OwningMessageSpectatorAllocator(OwningMessageSpectatorAllocator&& other) noexcept : mResource{ other.mResource }
+  {
+    other.mResource = nullptr;
+  }
+  explicit OwningMessageSpectatorAllocator(MessageResource* resource) noexcept : mResource{ resource } {}
 
   template <class U>
   OwningMessageSpectatorAllocator(const OwningMessageSpectatorAllocator<U>& other) noexcept : mResource(other.mResource)
   {
   }
 
-  OwningMessageSpectatorAllocator& operator=(const OwningMessageSpectatorAllocator& other)
+  OwningMessageSpectatorAllocator& operator=(const OwningMessageSpectatorAllocator& other) noexcept = default;
+  OwningMessageSpectatorAllocator& operator=(OwningMessageSpectatorAllocator&& other) noexcept
   {
     mResource = other.mResource;
+    other.mResource = nullptr;
     return *this;
   }
 
+  // a template, so only copying a container (not declaring it) trips the assertion
+  template <typename U = T>
   OwningMessageSpectatorAllocator select_on_container_copy_construction() const
   {
+    static_assert(sizeof(U) == 0, "a container adopting a message cannot be copied, move it");
     return OwningMessageSpectatorAllocator();
   }
 
-  boost::container::pmr::memory_resource* resource() { return &mResource; }
+  MessageResource* resource() const noexcept { return mResource; }
 
   // skip default construction of empty elements
   // this is important for two reasons: one: it allows us to adopt an existing buffer (e.g. incoming message) and
@@ -253,16 +1120,82 @@ public:
   {
   }
 
-  T* allocate(size_t size) { return reinterpret_cast<T*>(mResource.allocate(size * sizeof(T), 0)); }
-  void deallocate(T* ptr, size_t size)
+  T* allocate(size_t size)
+  {
+    if (!mResource) {
+      throw std::bad_alloc();
+    }
+    return reinterpret_cast<T*>(mResource->allocate(size * sizeof(T), 0));
+  }
+  void deallocate(T* /*ptr*/, size_t /*size*/) noexcept
+  {
+    delete mResource;
+    mResource = nullptr;
+  }
+
+  template <typename U>
+  bool operator==(const OwningMessageSpectatorAllocator<U>& other) const noexcept
+  {
+    return mResource == other.mResource;
+  }
+  template <typename U>
+  bool operator!=(const OwningMessageSpectatorAllocator<U>& other) const noexcept
   {
-    mResource.deallocate(const_cast<typename std::remove_cv<T>::type*>(ptr), size);
+    return mResource != other.mResource;
   }
 };
 
 using ByteSpectatorAllocator = SpectatorAllocator<byte>;
 using BytePmrAllocator = boost::container::pmr::polymorphic_allocator<byte>;
 
+namespace internal {
+//__________________________________________________________________________________________________
+/// free function of messages adopting the buffer of another message, the hint is the origin message
+inline void releaseOriginMessage(void* /*data*/, void* hint) { delete static_cast<FairMQMessage*>(hint); }
+
+inline std::atomic<size_t>& copyFallbackCounter()
+{
+  static std::atomic<size_t> counter{ 0 };
+  return counter;
+}
+
+//__________________________________________________________________________________________________
+/// hand a message (nullptr if there is none to give) holding bytes at data over to the target transport:
+/// as is if there is no target or it is the origin transport, adopted if the target can point to it, copied
+/// from data otherwise
+inline FairMQMessagePtr handOver(FairMQMessagePtr message, const void* data, size_t bytes,
+                                 const FairMQTransportFactory* originFactory, FairMQMemoryResource* targetResource)
+{
+  auto targetFactory = targetResource ? targetResource->getTransportFactory() : nullptr;
+  if (message) {
+    message->SetUsedSize(bytes);
+    if (!targetFactory || targetFactory == originFactory) {
+      return message;
+    }
+    if (targetFactory->CanAdopt(originFactory)) {
+      // the adopting message returns the buffer to its origin when it dies
+      void* buffer = message->GetData();
+      return targetFactory->CreateMessage(buffer, bytes, &releaseOriginMessage, message.release());
+    }
+  }
+  if (!targetFactory) {
+    return nullptr;
+  }
+  copyFallbackCounter().fetch_add(1, std::memory_order_relaxed);
+  FAKEMQ_STATS(targetResource->resourceStats().copied(bytes));
+  auto copy = targetFactory->CreateMessage(bytes);
+  bulkCopy(copy->GetData(), data, bytes);
+  return copy;
+}
+}
+
+//__________________________________________________________________________________________________
+/// number of times getMessage() had to copy the container because the target transport could not adopt it
+inline size_t getMessageCopyFallbacks() noexcept
+{
+  return internal::copyFallbackCounter().load(std::memory_order_relaxed);
+}
+
 //__________________________________________________________________________________________________
 // return the message associated with the container or nullptr if it does not make sense (e.g. when we are just
 // watching an existing message or when the container is not using FairMQMemoryResource as backend).
@@ -288,12 +1221,47 @@ FairMQMessagePtr getMessage(ContainerT&& container_, FairMQMemoryResource* targe
     return std::move(message);
   }
   else {
-    auto message = targetResource->getTransportFactory()->CreateMessage(containerSizeBytes);
-    std::memcpy(static_cast<byte*>(message->GetData()), container.data(), containerSizeBytes);
-    return std::move(message);
+    // a different resource: the message goes as is to the same transport, adopted by one that can point to its
+    // buffer, otherwise it stays with the container (which still frees it) and the data are copied
+    auto targetFactory = targetResource->getTransportFactory();
+    auto originFactory = resource ? resource->getTransportFactory() : nullptr;
+    FairMQMessagePtr origin;
+    if (resource && (targetFactory == originFactory || targetFactory->CanAdopt(originFactory))) {
+      origin = resource->getMessage(static_cast<void*>(
+        const_cast<typename std::remove_const<typename ContainerT::value_type>::type*>(container.data())));
+    }
+    return internal::handOver(std::move(origin), container.data(), containerSizeBytes, originFactory, targetResource);
   }
 };
 
+//__________________________________________________________________________________________________
+/// The message of a header stack. An allocated stack goes as for any container (with a new_delete or arena
+/// allocator the target resource is needed, the message adopts the buffer and frees it through the allocator).
+/// An inline stack is written straight into a new message of the target transport, the stack of the resource it
+/// was allocated with if there is no target.
+inline FairMQMessagePtr getMessage(Stack&& stack_, FairMQMemoryResource* targetResource = nullptr)
+{
+  Stack stack = std::move(stack_);
+  auto resource = dynamic_cast<FairMQMemoryResource*>(stack.get_allocator().resource());
+  if (!stack.isInline()) {
+    if (resource || !targetResource) {
+      return getMessage<Stack>(std::move(stack), targetResource);
+    }
+    auto hint = stack.getFreefnHint();
+    size_t size = stack.size();
+    return targetResource->getTransportFactory()->CreateMessage(stack.release(), size, Stack::getFreefn(), hint);
+  }
+  if (!targetResource) {
+    targetResource = resource;
+  }
+  if (!targetResource) {
+    throw std::runtime_error("Neither the container or target resource specified");
+  }
+  auto message = targetResource->getTransportFactory()->CreateMessage(stack.size());
+  std::memcpy(message->GetData(), stack.data(), stack.size());
+  return message;
+}
+
 //__________________________________________________________________________________________________
 template <typename ElemT>
 auto adoptVector(size_t nelem, FairMQMemoryResource* resource)
@@ -305,10 +1273,38 @@ auto adoptVector(size_t nelem, FairMQMemoryResource* resource)
 template <typename ElemT>
 auto adoptVector(size_t nelem, FairMQMemoryResource* upstream, FairMQMessagePtr message)
 {
-  return std::vector<const ElemT, OwningMessageSpectatorAllocator<ElemT>>(
-    nelem, OwningMessageSpectatorAllocator<ElemT>(MessageResource{ std::move(message), upstream }));
+  std::unique_ptr<MessageResource> resource{ new MessageResource{ std::move(message), upstream } };
+  if (nelem == 0) {
+    // nothing is allocated, so nothing would ever be deallocated either: no control block to hand over
+    return std::vector<const ElemT, OwningMessageSpectatorAllocator<ElemT>>();
+  }
+  auto vector = std::vector<const ElemT, OwningMessageSpectatorAllocator<ElemT>>(
+    nelem, OwningMessageSpectatorAllocator<ElemT>(resource.get()));
+  resource.release(); // owned by the allocation now
+  return vector;
 };
 
+//__________________________________________________________________________________________________
+/// Adopt and convert: the nelem SourceT of message (in the given byte order) as a vector of nelem ElemT, e.g. 16 bit
+/// big endian samples as native 32 bit ones. The conversion is a single pass of the BulkCopyEngine into a new message
+/// of the upstream transport, owned by the vector as with the adoptVector() above, so getMessage() sends it on
+/// without another copy. The source message is not touched.
+template <typename ElemT, typename SourceT = ElemT>
+auto adoptVector(size_t nelem, FairMQMemoryResource* upstream, const FairMQMessage& message, ByteOrder order)
+{
+  // the sizes below must not wrap around, a huge nelem would pass as a small message and a small conversion
+  if (nelem > SIZE_MAX / (sizeof(ElemT) > sizeof(SourceT) ? sizeof(ElemT) : sizeof(SourceT))) {
+    throw std::out_of_range("adoptVector: too many elements");
+  }
+  if (message.GetSize() < nelem * sizeof(SourceT)) {
+    throw std::out_of_range("adoptVector: the message is too small for the elements");
+  }
+  auto converted = upstream->getTransportFactory()->CreateMessage(nelem * sizeof(ElemT));
+  BulkCopyEngine::instance().convert(static_cast<ElemT*>(converted->GetData()),
+                                     static_cast<const SourceT*>(message.GetData()), nelem, order);
+  return adoptVector<ElemT>(nelem, upstream, std::move(converted));
+}
+
 //__________________________________________________________________________________________________
 // This returns a unique_ptr of const vector, does not allow modifications at the cost of pointer
 // semantics for access.
@@ -332,9 +1328,791 @@ auto adoptVector(size_t nelem, FairMQMessage* message)
   return OutputType(output, doubleDeleter{ std::move(resource) });
 }
 
+//__________________________________________________________________________________________________
+/// Read-only view of a message buffer as an array of T, adopting it in O(1): unlike the adoptVector() containers
+/// no element is ever constructed and nothing has to be cast away on the way back (getMessage()).
+/// Depending on how it is made (see adoptView()) the view owns a message, watches one, or holds a buffer of a
+/// FairMQMemoryResource which it deallocates when it dies.
+template <typename T>
+class MessageView {
+  static_assert(std::is_trivially_copyable<T>::value, "MessageView can only present trivially copyable types");
+  static_assert(alignof(T) <= alignof(std::max_align_t), "message buffers are only aligned to max_align_t");
+
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using const_reference = const T&;
+  using const_pointer = const T*;
+  using const_iterator = const T*;
+  using iterator = const_iterator;
+
+  MessageView() noexcept = default;
+  /// watch the message, it has to outlive the view
+  MessageView(size_t nelem, const FairMQMessage* message)
+  {
+    adopt(nelem, message ? message->GetData() : nullptr, message ? message->GetSize() : 0);
+  }
+  /// own the message, upstream (optional) is the resource it came from, it tells getMessage() its transport
+  MessageView(size_t nelem, FairMQMessagePtr message, FairMQMemoryResource* upstream = nullptr)
+  {
+#if FAKEMQ_ENABLE_STATS
+    if (upstream) {
+      if (nelem * sizeof(T) > (message ? message->GetSize() : 0)) {
+        upstream->resourceStats().badAlloc();
+      }
+      else {
+        upstream->resourceStats().adopted();
+      }
+    }
+#endif
+    adopt(nelem, message ? message->GetData() : nullptr, message ? message->GetSize() : 0);
+    mMessage = std::move(message);
+    mResource = upstream;
+  }
+  /// view nelem elements allocated from the resource, e.g. a SpectatorMessageResource watching a message
+  MessageView(size_t nelem, FairMQMemoryResource* resource)
+  {
+    if (!resource) {
+      throw std::runtime_error("MessageView: resource is nullptr");
+    }
+    void* buffer = resource->allocate(nelem * sizeof(T), alignof(T));
+    if (!buffer && nelem) {
+      FAKEMQ_STATS(resource->resourceStats().badAlloc());
+      throw std::bad_alloc();
+    }
+    mResource = resource;
+    mBuffer = static_cast<byte*>(buffer);
+    mSize = nelem;
+    if (!aligned(buffer)) {
+      reset();
+      throw std::runtime_error("MessageView: buffer is not aligned for the element type");
+    }
+  }
+  MessageView(const MessageView&) = delete;
+  MessageView& operator=(const MessageView&) = delete;
+  MessageView(MessageView&& other) noexcept
+    : mBuffer{ other.mBuffer }, mSize{ other.mSize }, mMessage{ std::move(other.mMessage) }, mResource{ other.mResource }
+  {
+    other.forget();
+  }
+  MessageView& operator=(MessageView&& other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      mBuffer = other.mBuffer;
+      mSize = other.mSize;
+      mMessage = std::move(other.mMessage);
+      mResource = other.mResource;
+      other.forget();
+    }
+    return *this;
+  }
+  ~MessageView() { reset(); }
+
+  const T* data() const noexcept { return reinterpret_cast<const T*>(mBuffer); }
+  size_t size() const noexcept { return mSize; }
+  bool empty() const noexcept { return mSize == 0; }
+  const T& operator[](size_t i) const noexcept { return data()[i]; }
+  const T& front() const noexcept { return data()[0]; }
+  const T& back() const noexcept { return data()[mSize - 1]; }
+  const_iterator begin() const noexcept { return data(); }
+  const_iterator end() const noexcept { return data() + mSize; }
+  const_iterator cbegin() const noexcept { return begin(); }
+  const_iterator cend() const noexcept { return end(); }
+
+  /// the upstream resource of an owning view, the allocating resource otherwise (nullptr if watching a message)
+  FairMQMemoryResource* getResource() const noexcept { return mResource; }
+  bool owning() const noexcept { return mMessage != nullptr; }
+
+  /// give up the message behind the view, its used size set to the viewed bytes. nullptr (and the view is left
+  /// as is) if there is none to give, i.e. the view watches a message or the resource does not hand out messages.
+  FairMQMessagePtr release()
+  {
+    auto message = std::move(mMessage);
+    if (!message && mResource && mBuffer) {
+      message = mResource->getMessage(mBuffer);
+      if (message) {
+        // as a container would: the allocation ends here, a no-op for resources that hand out their message
+        mResource->deallocate(mBuffer, mSize * sizeof(T), alignof(T));
+      }
+    }
+    if (message) {
+      message->SetUsedSize(mSize * sizeof(T));
+      forget();
+    }
+    return message;
+  }
+
+  void reset() noexcept
+  {
+    if (!mMessage && mResource && mBuffer) {
+      mResource->deallocate(mBuffer, mSize * sizeof(T), alignof(T));
+    }
+    if (mMessage && mResource) {
+      mResource->releaseMessage(std::move(mMessage));
+    }
+    mMessage = nullptr;
+    forget();
+  }
+
+private:
+  byte* mBuffer{ nullptr };
+  size_t mSize{ 0 };
+  FairMQMessagePtr mMessage{ nullptr };
+  FairMQMemoryResource* mResource{ nullptr };
+
+  static bool aligned(const void* p) noexcept { return reinterpret_cast<uintptr_t>(p) % alignof(T) == 0; }
+
+  void adopt(size_t nelem, void* buffer, size_t bytes)
+  {
+    if (nelem * sizeof(T) > bytes) {
+      throw std::bad_alloc();
+    }
+    if (!aligned(buffer)) {
+      throw std::runtime_error("MessageView: buffer is not aligned for the element type");
+    }
+    mBuffer = static_cast<byte*>(buffer);
+    mSize = nelem;
+  }
+
+  void forget() noexcept
+  {
+    mBuffer = nullptr;
+    mSize = 0;
+    mResource = nullptr;
+  }
+};
+
+//__________________________________________________________________________________________________
+/// the adoptVector() counterparts returning a MessageView: watch a buffer allocated from the resource ...
+template <typename ElemT>
+MessageView<ElemT> adoptView(size_t nelem, FairMQMemoryResource* resource)
+{
+  return MessageView<ElemT>(nelem, resource);
+}
+
+/// ... take ownership of a message ...
+template <typename ElemT>
+MessageView<ElemT> adoptView(size_t nelem, FairMQMemoryResource* upstream, FairMQMessagePtr message)
+{
+  return MessageView<ElemT>(nelem, std::move(message), upstream);
+}
+
+/// ... or watch a message that outlives the view
+template <typename ElemT>
+MessageView<ElemT> adoptView(size_t nelem, const FairMQMessage* message)
+{
+  return MessageView<ElemT>(nelem, message);
+}
+
+//__________________________________________________________________________________________________
+/// the message behind the view, handed to the target transport (by default the one it came from) without a copy
+/// if that transport can point to it. A view watching a message gives nullptr unless a target is given, the
+/// data is then copied.
+template <typename T>
+FairMQMessagePtr getMessage(MessageView<T>&& view, FairMQMemoryResource* targetResource = nullptr)
+{
+  auto originFactory = view.getResource() ? view.getResource()->getTransportFactory() : nullptr;
+  const T* data = view.data();
+  size_t sizeBytes = view.size() * sizeof(T);
+  return internal::handOver(view.release(), data, sizeBytes, originFactory, targetResource);
+}
+
+//__________________________________________________________________________________________________
+/// the message adopted by adoptVector(nelem, upstream, message), taken straight out of the allocator's control
+/// block: no registry lookup and, without a target of another transport, no copy
+template <typename T>
+FairMQMessagePtr getMessage(std::vector<const T, OwningMessageSpectatorAllocator<T>>&& container_,
+                            FairMQMemoryResource* targetResource = nullptr)
+{
+  auto container = std::move(container_);
+  auto resource = container.get_allocator().resource();
+  if (!resource) {
+    return nullptr; // moved from, or never adopted anything
+  }
+  size_t sizeBytes = container.size() * sizeof(T);
+  return internal::handOver(resource->release(), container.data(), sizeBytes,
+                            resource->getTransportFactory(), targetResource);
+}
+
+//__________________________________________________________________________________________________
+/// Append-only vector living in a reserved range of virtual address space instead of a message: growing only
+/// commits more pages of the range, elements never move and are never copied. Outgrowing the reservation
+/// remaps the pages to a larger range (mremap moves page table entries, not data).
+/// getMessage() hands the committed pages to the transport as a single message without a copy.
+/// As with the SpectatorAllocator, element destructors are not called.
+template <typename T>
+class GrowableMessageVector {
+public:
+  using value_type = T;
+  using iterator = T*;
+  using const_iterator = const T*;
+
+  /// reserve (but do not commit) virtual memory for reservedBytes, the transport is taken from the resource
+  GrowableMessageVector(FairMQMemoryResource* resource, size_t reservedBytes = size_t{ 1 } << 30)
+    : mResource{ resource }
+  {
+    if (!mResource || !mResource->getTransportFactory()) {
+      throw std::runtime_error("GrowableMessageVector needs a resource with a transport factory");
+    }
+    mReserved = roundUp(std::max(reservedBytes, sizeof(T)), pageSize());
+    void* base = mmap(nullptr, mReserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    mData = static_cast<T*>(base);
+  }
+  GrowableMessageVector(const GrowableMessageVector&) = delete;
+  GrowableMessageVector& operator=(const GrowableMessageVector&) = delete;
+  GrowableMessageVector(GrowableMessageVector&& other) noexcept
+    : mResource{ other.mResource },
+      mData{ other.mData },
+      mSize{ other.mSize },
+      mCommitted{ other.mCommitted },
+      mReserved{ other.mReserved }
+  {
+    other.mData = nullptr;
+    other.mSize = other.mCommitted = other.mReserved = 0;
+  }
+  GrowableMessageVector& operator=(GrowableMessageVector&& other) noexcept
+  {
+    std::swap(mResource, other.mResource);
+    std::swap(mData, other.mData);
+    std::swap(mSize, other.mSize);
+    std::swap(mCommitted, other.mCommitted);
+    std::swap(mReserved, other.mReserved);
+    return *this;
+  }
+  ~GrowableMessageVector()
+  {
+    if (mData) {
+      munmap(mData, mReserved);
+    }
+  }
+
+  size_t size() const noexcept { return mSize; }
+  bool empty() const noexcept { return mSize == 0; }
+  size_t capacity() const noexcept { return mCommitted / sizeof(T); }
+  T* data() noexcept { return mData; }
+  const T* data() const noexcept { return mData; }
+  T& operator[](size_t i) noexcept { return mData[i]; }
+  const T& operator[](size_t i) const noexcept { return mData[i]; }
+  T& back() noexcept { return mData[mSize - 1]; }
+  iterator begin() noexcept { return mData; }
+  iterator end() noexcept { return mData + mSize; }
+  const_iterator begin() const noexcept { return mData; }
+  const_iterator end() const noexcept { return mData + mSize; }
+  FairMQMemoryResource* getResource() const noexcept { return mResource; }
+
+  void reserve(size_t n) { commit(n * sizeof(T)); }
+
+  /// grow (new elements are not initialized) or shrink
+  void resize(size_t n)
+  {
+    reserve(n);
+    mSize = n;
+  }
+  void clear() noexcept { mSize = 0; }
+
+  template <typename... Args>
+  T& emplace_back(Args&&... args)
+  {
+    if (mSize == capacity()) {
+      reserve(mSize + 1);
+    }
+    return *new (mData + mSize++) T(std::forward<Args>(args)...);
+  }
+  void push_back(const T& value) { emplace_back(value); }
+  void push_back(T&& value) { emplace_back(std::move(value)); }
+
+  /// give up the mapping, returns its base and length in bytes: the committed pages, at least one, all accessible.
+  /// The unused tail of the reservation is unmapped, the remaining pages have to be freed with munmap().
+  std::pair<void*, size_t> release()
+  {
+    if (!mData) {
+      return { nullptr, 0 };
+    }
+    if (mCommitted == 0) {
+      if (mprotect(mData, pageSize(), PROT_READ | PROT_WRITE) != 0) {
+        throw std::bad_alloc();
+      }
+      mCommitted = pageSize();
+    }
+    size_t length = mCommitted;
+    if (length < mReserved) {
+      munmap(reinterpret_cast<byte*>(mData) + length, mReserved - length);
+    }
+    std::pair<void*, size_t> region{ mData, length };
+    mData = nullptr;
+    mSize = mCommitted = mReserved = 0;
+    return region;
+  }
+
+  /// free function for messages adopting a released region, the hint is the length of the region
+  static void unmapRegion(void* data, void* hint) { munmap(data, reinterpret_cast<uintptr_t>(hint)); }
+
+private:
+  FairMQMemoryResource* mResource{ nullptr };
+  T* mData{ nullptr };
+  size_t mSize{ 0 };
+  size_t mCommitted{ 0 };
+  size_t mReserved{ 0 };
+
+  static size_t pageSize() noexcept
+  {
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+  }
+  static size_t roundUp(size_t n, size_t to) noexcept { return (n + to - 1) / to * to; }
+
+  // make at least bytes accessible, growing geometrically so push_back stays amortized O(1) in syscalls
+  void commit(size_t bytes)
+  {
+    if (bytes <= mCommitted) {
+      return;
+    }
+    size_t wanted = roundUp(std::max({ bytes, 2 * mCommitted, size_t{ 1 } << 16 }), pageSize());
+    if (wanted > mReserved) {
+      remap(std::max(wanted, 2 * mReserved));
+    }
+    wanted = std::min(wanted, mReserved);
+    if (mprotect(reinterpret_cast<byte*>(mData) + mCommitted, wanted - mCommitted, PROT_READ | PROT_WRITE) != 0) {
+      throw std::bad_alloc();
+    }
+    mCommitted = wanted;
+  }
+
+  void remap(size_t reserved)
+  {
+#ifdef __linux__
+    // mremap only moves a single mapping: make the whole old range accessible first, it is backed lazily anyway
+    if (mCommitted < mReserved) {
+      if (mprotect(reinterpret_cast<byte*>(mData) + mCommitted, mReserved - mCommitted, PROT_READ | PROT_WRITE) != 0) {
+        throw std::bad_alloc();
+      }
+      mCommitted = mReserved;
+    }
+    void* base = mremap(mData, mReserved, reserved, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+      throw std::bad_alloc();
+    }
+    // the grown part inherits the access of the old range, take it back until it is committed
+    mprotect(static_cast<byte*>(base) + mReserved, reserved - mReserved, PROT_NONE);
+    mData = static_cast<T*>(base);
+    mReserved = reserved;
+#else
+    throw std::bad_alloc();
+#endif
+  }
+};
+
+//__________________________________________________________________________________________________
+/// hand the committed pages of the vector to the target transport (by default the one of the vector's resource),
+/// they are only copied if that transport cannot point to process memory. Either way the vector is left empty.
+template <typename T>
+FairMQMessagePtr getMessage(GrowableMessageVector<T>&& vector_, FairMQMemoryResource* targetResource = nullptr)
+{
+  auto vector = std::move(vector_);
+  auto resource = targetResource ? targetResource : vector.getResource();
+  auto factory = resource ? resource->getTransportFactory() : nullptr;
+  if (!factory) {
+    throw std::runtime_error("Neither the container or target resource specified");
+  }
+  size_t sizeBytes = vector.size() * sizeof(T);
+  if (!factory->CanAdopt(nullptr)) {
+    internal::copyFallbackCounter().fetch_add(1, std::memory_order_relaxed);
+    FAKEMQ_STATS(resource->resourceStats().copied(sizeBytes));
+    auto message = factory->CreateMessage(sizeBytes);
+    bulkCopy(message->GetData(), vector.data(), sizeBytes);
+    return message;
+  }
+  auto region = vector.release();
+  auto message = factory->CreateMessage(region.first, region.second, &GrowableMessageVector<T>::unmapRegion,
+                                        reinterpret_cast<void*>(static_cast<uintptr_t>(region.second)));
+  message->SetUsedSize(sizeBytes);
+  return message;
+}
+
+//__________________________________________________________________________________________________
+/// Append-only container made of fixed size message-backed blocks allocated from a FairMQMemoryResource.
+/// Appending never reallocates or copies; getParts() ships every block as one part of a FairMQParts.
+/// As with the SpectatorAllocator, element destructors are not called.
+template <typename T>
+class ChunkedMessageVector {
+public:
+  using value_type = T;
+
+  ChunkedMessageVector(FairMQMemoryResource* resource, size_t blockBytes = size_t{ 1 } << 20)
+    : mResource{ resource }, mBlockCapacity{ std::max(blockBytes / sizeof(T), size_t{ 1 }) }
+  {
+    if (!mResource) {
+      throw std::runtime_error("ChunkedMessageVector needs a resource");
+    }
+  }
+  ChunkedMessageVector(const ChunkedMessageVector&) = delete;
+  ChunkedMessageVector& operator=(const ChunkedMessageVector&) = delete;
+  ChunkedMessageVector(ChunkedMessageVector&& other) noexcept
+    : mResource{ other.mResource }, mBlockCapacity{ other.mBlockCapacity }, mBlocks{ std::move(other.mBlocks) }, mSize{ other.mSize }
+  {
+    other.mBlocks.clear();
+    other.mSize = 0;
+  }
+  ~ChunkedMessageVector() { clear(); }
+
+  size_t size() const noexcept { return mSize; }
+  bool empty() const noexcept { return mSize == 0; }
+  size_t blockCapacity() const noexcept { return mBlockCapacity; }
+  size_t numberOfBlocks() const noexcept { return mBlocks.size(); }
+  FairMQMemoryResource* getResource() const noexcept { return mResource; }
+
+  T& operator[](size_t i) noexcept { return mBlocks[i / mBlockCapacity][i % mBlockCapacity]; }
+  const T& operator[](size_t i) const noexcept { return mBlocks[i / mBlockCapacity][i % mBlockCapacity]; }
+  T& back() noexcept { return (*this)[mSize - 1]; }
+
+  template <typename... Args>
+  T& emplace_back(Args&&... args)
+  {
+    size_t inBlock = mSize % mBlockCapacity;
+    if (inBlock == 0 && mSize / mBlockCapacity == mBlocks.size()) {
+      mBlocks.push_back(static_cast<T*>(mResource->allocate(mBlockCapacity * sizeof(T), alignof(T))));
+    }
+    T* place = mBlocks[mSize / mBlockCapacity] + inBlock;
+    ++mSize;
+    return *new (place) T(std::forward<Args>(args)...);
+  }
+  void push_back(const T& value) { emplace_back(value); }
+  void push_back(T&& value) { emplace_back(std::move(value)); }
+
+  void clear() noexcept
+  {
+    for (auto block : mBlocks) {
+      mResource->deallocate(block, mBlockCapacity * sizeof(T), alignof(T));
+    }
+    mBlocks.clear();
+    mSize = 0;
+  }
+
+  /// take the blocks out as messages, the last one marked as partially used
+  void extractParts(FairMQParts& parts)
+  {
+    size_t remaining = mSize;
+    for (auto block : mBlocks) {
+      auto message = mResource->getMessage(block);
+      if (!message) {
+        throw std::runtime_error("ChunkedMessageVector: resource does not own the block messages");
+      }
+      size_t count = std::min(remaining, mBlockCapacity);
+      message->SetUsedSize(count * sizeof(T));
+      remaining -= count;
+      parts.AddPart(std::move(message));
+    }
+    mBlocks.clear();
+    mSize = 0;
+  }
+
+private:
+  FairMQMemoryResource* mResource{ nullptr };
+  size_t mBlockCapacity{ 0 };
+  std::vector<T*> mBlocks{};
+  size_t mSize{ 0 };
+};
+
+//__________________________________________________________________________________________________
+/// ship the container as a multi part message, one part per block, without copying
+template <typename T>
+FairMQParts getParts(ChunkedMessageVector<T>&& container)
+{
+  FairMQParts parts;
+  container.extractParts(parts);
+  return parts;
+}
+
+//__________________________________________________________________________________________________
+/// Read side counterpart of the ChunkedMessageVector: presents the (used) payload of all parts of a FairMQParts
+/// as one range of T. The view does not own the parts, they must outlive it.
+template <typename T>
+class PartsView {
+  struct Chunk {
+    const T* data;
+    size_t size;
+  };
+
+public:
+  class const_iterator {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = T;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const T*;
+    using reference = const T&;
+
+    const_iterator() = default;
+    const_iterator(const Chunk* chunk, const Chunk* last) : mChunk{ chunk }, mLast{ last } { skipEmpty(); }
+
+    reference operator*() const noexcept { return mChunk->data[mIndex]; }
+    pointer operator->() const noexcept { return mChunk->data + mIndex; }
+    const_iterator& operator++() noexcept
+    {
+      if (++mIndex == mChunk->size) {
+        ++mChunk;
+        mIndex = 0;
+        skipEmpty();
+      }
+      return *this;
+    }
+    const_iterator operator++(int) noexcept
+    {
+      auto tmp = *this;
+      ++(*this);
+      return tmp;
+    }
+    bool operator==(const const_iterator& other) const noexcept
+    {
+      return mChunk == other.mChunk && mIndex == other.mIndex;
+    }
+    bool operator!=(const const_iterator& other) const noexcept { return !(*this == other); }
+
+  private:
+    const Chunk* mChunk{ nullptr };
+    const Chunk* mLast{ nullptr };
+    size_t mIndex{ 0 };
+
+    void skipEmpty() noexcept
+    {
+      while (mChunk != mLast && mChunk->size == 0) {
+        ++mChunk;
+      }
+    }
+  };
+
+  explicit PartsView(FairMQParts& parts)
+  {
+    mChunks.reserve(parts.Size());
+    for (auto& part : parts) {
+      size_t bytes = part->GetUsedSize();
+      if (bytes % sizeof(T) != 0 || reinterpret_cast<uintptr_t>(part->GetData()) % alignof(T) != 0) {
+        throw std::runtime_error("PartsView: part is not an aligned array of the element type");
+      }
+      mChunks.push_back(Chunk{ static_cast<const T*>(part->GetData()), bytes / sizeof(T) });
+      mSize += bytes / sizeof(T);
+    }
+  }
+
+  size_t size() const noexcept { return mSize; }
+  bool empty() const noexcept { return mSize == 0; }
+  size_t numberOfChunks() const noexcept { return mChunks.size(); }
+  /// the contiguous pieces, for loops that want to process chunk by chunk
+  const T* chunkData(size_t i) const noexcept { return mChunks[i].data; }
+  size_t chunkSize(size_t i) const noexcept { return mChunks[i].size; }
+
+  const_iterator begin() const noexcept { return const_iterator(mChunks.data(), mChunks.data() + mChunks.size()); }
+  const_iterator end() const noexcept
+  {
+    return const_iterator(mChunks.data() + mChunks.size(), mChunks.data() + mChunks.size());
+  }
+
+private:
+  std::vector<Chunk> mChunks{};
+  size_t mSize{ 0 };
+};
+
+//__________________________________________________________________________________________________
+template <typename ElemT>
+PartsView<ElemT> adoptParts(FairMQParts& parts)
+{
+  return PartsView<ElemT>(parts);
+}
+
+//__________________________________________________________________________________________________
+struct HeaderArenaStats {
+  size_t allocations{ 0 };   // served from the arena
+  size_t heapFallbacks{ 0 }; // too large for the arena, served from the heap
+  size_t blocks{ 0 };        // arena blocks allocated
+  size_t retiredBlocks{ 0 }; // blocks given up while still used by live stacks
+  size_t blockSize{ 0 };
+  size_t used{ 0 };          // bytes used in the current block
+  size_t peakUsed{ 0 };      // highest use of a block
+  size_t live{ 0 };          // allocations in the current block not yet freed
+  double occupancy() const noexcept { return blockSize ? static_cast<double>(used) / blockSize : 0.; }
+};
+
+//__________________________________________________________________________________________________
+/// Per-thread bump allocator for header stacks, meant to be passed as the Stack allocator:
+///   Stack stack{ HeaderArenaResource::threadLocal(), DataHeader{}, LargeHeader{} };
+/// (stacks up to Stack::inlineCapacity() do not allocate at all).
+/// Allocation is a pointer bump in the current block. Memory is reclaimed in bulk by newCycle(): if every stack
+/// of the cycle is gone the block is simply rewound. A stack living longer keeps its block alive (reference
+/// counted) and the arena continues in a fresh block. Requests too large for the arena go to the heap.
+/// Allocation is for the owning thread only. Deallocation (e.g. the Stack::getFreefn() of a message that got the
+/// stack buffer) is safe from any thread and at any time: it only touches the block, never the arena.
+class HeaderArenaResource : public boost::container::pmr::memory_resource {
+  struct Block {
+    std::atomic<size_t> refs; // live allocations, +1 while it is the current block of the arena
+    size_t size;              // usable bytes after the Block header
+  };
+  // every allocation is preceded by the block it came from, nullptr for heap allocations
+  struct alignas(std::max_align_t) Prefix {
+    Block* block;
+    void* heap; // what operator new returned for a heap allocation
+  };
+  static constexpr size_t granularity = alignof(std::max_align_t);
+
+public:
+  HeaderArenaResource(size_t blockSize = size_t{ 1 } << 16) : mBlockSize{ blockSize } {}
+  HeaderArenaResource(const HeaderArenaResource&) = delete;
+  HeaderArenaResource& operator=(const HeaderArenaResource&) = delete;
+  ~HeaderArenaResource() { retire(); }
+
+  /// the arena of the calling thread. The resource object is never destroyed, messages may still point to it
+  /// as the free function hint: at thread exit its block is given up and the object is kept for the next thread.
+  static HeaderArenaResource* threadLocal()
+  {
+    struct Holder {
+      HeaderArenaResource* arena{ acquire() };
+      ~Holder()
+      {
+        arena->retire();
+        std::lock_guard<std::mutex> guard(spareMutex());
+        spares().push_back(arena);
+      }
+    };
+    static thread_local Holder holder;
+    return holder.arena;
+  }
+
+  /// end of a processing cycle: rewind the block if all its stacks are gone, move on to a new one otherwise
+  void newCycle() noexcept
+  {
+    if (!mBlock) {
+      return;
+    }
+    if (mBlock->refs.load(std::memory_order_acquire) == 1) {
+      mUsed = 0;
+    }
+    else {
+      retire();
+    }
+  }
+
+  HeaderArenaStats getStats() const noexcept
+  {
+    HeaderArenaStats stats = mStats;
+    stats.blockSize = mBlockSize;
+    stats.used = mUsed;
+    stats.live = mBlock ? mBlock->refs.load(std::memory_order_relaxed) - 1 : 0;
+    return stats;
+  }
+
+protected:
+  void* do_allocate(std::size_t bytes, std::size_t alignment) override
+  {
+    size_t need = roundUp(sizeof(Prefix) + bytes);
+    if (alignment > granularity || need > mBlockSize / 4) {
+      // no aligned new in C++14: over-allocate and align by hand, operator new is aligned to granularity
+      ++mStats.heapFallbacks;
+      const size_t align = alignment > granularity ? alignment : granularity;
+      void* heap = ::operator new(sizeof(Prefix) + bytes + align - granularity);
+      uintptr_t user = (reinterpret_cast<uintptr_t>(heap) + sizeof(Prefix) + align - 1) / align * align;
+      return place(reinterpret_cast<byte*>(user) - sizeof(Prefix), nullptr, heap);
+    }
+    if (!mBlock || mUsed + need > mBlock->size) {
+      retire();
+      mBlock = static_cast<Block*>(::operator new(sizeof(Block) + mBlockSize));
+      new (mBlock) Block{ { 1 }, mBlockSize };
+      ++mStats.blocks;
+    }
+    byte* here = reinterpret_cast<byte*>(mBlock) + sizeof(Block) + mUsed;
+    mUsed += need;
+    mStats.peakUsed = std::max(mStats.peakUsed, mUsed);
+    ++mStats.allocations;
+    mBlock->refs.fetch_add(1, std::memory_order_relaxed);
+    return place(here, mBlock);
+  }
+
+  void do_deallocate(void* p, std::size_t /*bytes*/, std::size_t /*alignment*/) override
+  {
+    if (!p) {
+      return;
+    }
+    Prefix* prefix = reinterpret_cast<Prefix*>(p) - 1;
+    if (prefix->block) {
+      unref(prefix->block);
+    }
+    else {
+      ::operator delete(prefix->heap);
+    }
+  }
+
+  bool do_is_equal(const boost::container::pmr::memory_resource& other) const noexcept override
+  {
+    return this == &other;
+  }
+
+private:
+  size_t mBlockSize{ 0 };
+  Block* mBlock{ nullptr };
+  size_t mUsed{ 0 };
+  HeaderArenaStats mStats{};
+
+  static size_t roundUp(size_t n) noexcept { return (n + granularity - 1) / granularity * granularity; }
+
+  // arenas of exited threads, process lifetime like the arenas themselves
+  static std::mutex& spareMutex()
+  {
+    static std::mutex* mutex = new std::mutex;
+    return *mutex;
+  }
+  static std::vector<HeaderArenaResource*>& spares()
+  {
+    static std::vector<HeaderArenaResource*>* arenas = new std::vector<HeaderArenaResource*>;
+    return *arenas;
+  }
+  static HeaderArenaResource* acquire()
+  {
+    std::lock_guard<std::mutex> guard(spareMutex());
+    if (spares().empty()) {
+      return new HeaderArenaResource();
+    }
+    auto arena = spares().back();
+    spares().pop_back();
+    return arena;
+  }
+
+  static void* place(void* memory, Block* block, void* heap = nullptr) noexcept
+  {
+    Prefix* prefix = new (memory) Prefix{ block, heap };
+    return prefix + 1;
+  }
+
+  static void unref(Block* block) noexcept
+  {
+    if (block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      block->~Block();
+      ::operator delete(block);
+    }
+  }
+
+  // give up the current block, it dies with its last stack
+  void retire() noexcept
+  {
+    if (mBlock) {
+      if (mBlock->refs.load(std::memory_order_relaxed) > 1) {
+        ++mStats.retiredBlocks;
+      }
+      unref(mBlock);
+      mBlock = nullptr;
+      mUsed = 0;
+    }
+  }
+};
+
 namespace internal {
 //__________________________________________________________________________________________________
-/// A (thread local) singleton placeholder for the channel allocators. There will normally be 1-2 elements in the map.
+/// Process wide singleton placeholder for the channel allocators, sharded per thread: every thread gets its own
+/// ChannelResource per factory, so the allocation hot path is never shared. There will normally be 1-2 factories.
+/// The resources are owned here and not by the thread, buffers handed to another thread stay valid after the
+/// allocating thread exits. Its resources are parked then and handed to the next thread asking for the same
+/// factory, so the number of resources is bounded by the number of threads alive at a time, not by those started.
 // Ideally the transport class itself would hold (or be) the allocator, if that ever happens, this can go away.
 class TransportAllocatorMap {
 public:
@@ -343,19 +2121,67 @@ public:
     static TransportAllocatorMap S;
     return S;
   }
+  /// lock free once the calling thread has seen the factory, only the first lookup per thread takes the lock
   ChannelResource* operator[](const FairMQTransportFactory* factory)
   {
-    return std::addressof(map.emplace(factory, factory).first->second);
+    auto& cache = threadCache();
+    for (auto& entry : cache) {
+      if (entry.first == factory) {
+        return entry.second;
+      }
+    }
+    ChannelResource* resource = create(factory);
+    cache.emplace_back(factory, resource);
+    return resource;
   }
 
 private:
-  std::unordered_map<const FairMQTransportFactory*, ChannelResource> map{};
+  using CacheType = std::vector<std::pair<const FairMQTransportFactory*, ChannelResource*>>;
+
+  // the resources of a thread, parked when it exits
+  struct ThreadCache : CacheType {
+    ~ThreadCache() { Instance().park(*this); }
+  };
+
+  std::mutex mMutex{};
+  std::vector<std::unique_ptr<ChannelResource>> mResources{};
+  CacheType mParked{}; // resources of exited threads
   TransportAllocatorMap(){};
+
+  static CacheType& threadCache()
+  {
+    static thread_local ThreadCache cache{};
+    return cache;
+  }
+
+  ChannelResource* create(const FairMQTransportFactory* factory)
+  {
+    std::lock_guard<std::mutex> guard(mMutex);
+    for (auto parked = mParked.begin(); parked != mParked.end(); ++parked) {
+      if (parked->first == factory) {
+        ChannelResource* resource = parked->second;
+        mParked.erase(parked);
+        return resource;
+      }
+    }
+    mResources.push_back(std::make_unique<ChannelResource>(factory));
+    return mResources.back().get();
+  }
+
+  void park(const CacheType& cache)
+  {
+    std::lock_guard<std::mutex> guard(mMutex);
+    mParked.insert(mParked.end(), cache.begin(), cache.end());
+  }
 };
 }
 
 //__________________________________________________________________________________________________
-/// Get the allocator associated to a transport factory
+/// Get the allocator associated to a transport factory, the calling thread's own one.
+/// Handoff between threads: a container allocated on thread A may be given to thread B, which makes its message
+/// with getMessage(std::move(container), getTransportAllocator(factory)). The resources differ, but their transport
+/// is the same, so B gets the very message A's resource allocated (no copy, no wrapping message). Frees of A's
+/// buffers on B go back to A's resource, which stays alive after A exits.
 inline static ChannelResource* getTransportAllocator(const FairMQTransportFactory* factory)
 {
   return internal::TransportAllocatorMap::Instance()[factory];
@@ -0,0 +1,351 @@
+#pragma once
+#include "fake.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// Validation of received messages: validateHeaders() checks a whole header chain against the length of its buffer
+// before anything walks it with BaseHeader::next(), validate() also checks the CRC32C which seal() embeds in the
+// DataHeader over the header stack and the payload. The checksum runs on the SSE4.2 crc32 instruction if the CPU has
+// it (three interleaved streams, well over 1 byte/cycle) and on a slicing-by-8 table otherwise.
+
+namespace internal {
+//__________________________________________________________________________________________________
+constexpr uint32_t crc32cPolynomial = 0x82f63b78; // Castagnoli, reflected
+constexpr size_t crc32cLongBlock = 8192;           // bytes per stream of the interleaved hardware loop
+constexpr size_t crc32cShortBlock = 256;
+
+/// lookup tables: slicing-by-8 for the software CRC and the operators appending crc32cLongBlock and
+/// crc32cShortBlock zero bytes to a CRC, to combine the interleaved streams of the hardware CRC
+struct Crc32cTables {
+  uint32_t slice[8][256];
+  uint32_t shiftLong[4][256];
+  uint32_t shiftShort[4][256];
+
+  Crc32cTables() noexcept
+  {
+    for (uint32_t n = 0; n < 256; ++n) {
+      uint32_t crc = n;
+      for (int k = 0; k < 8; ++k) {
+        crc = crc & 1 ? (crc >> 1) ^ crc32cPolynomial : crc >> 1;
+      }
+      slice[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; ++n) {
+      for (int k = 1; k < 8; ++k) {
+        slice[k][n] = (slice[k - 1][n] >> 8) ^ slice[0][slice[k - 1][n] & 0xff];
+      }
+    }
+    zeros(shiftLong, crc32cLongBlock);
+    zeros(shiftShort, crc32cShortBlock);
+  }
+
+ private:
+  static uint32_t times(const uint32_t* matrix, uint32_t vector) noexcept
+  {
+    uint32_t sum = 0;
+    for (; vector; vector >>= 1, ++matrix) {
+      if (vector & 1) {
+        sum ^= *matrix;
+      }
+    }
+    return sum;
+  }
+
+  static void square(uint32_t* result, const uint32_t* matrix) noexcept
+  {
+    for (int n = 0; n < 32; ++n) {
+      result[n] = times(matrix, matrix[n]);
+    }
+  }
+
+  // the operator for len zero bytes (len a power of two) as byte wise tables
+  static void zeros(uint32_t (&table)[4][256], size_t len) noexcept
+  {
+    uint32_t even[32];
+    uint32_t odd[32];
+    odd[0] = crc32cPolynomial; // one zero bit
+    for (int n = 1; n < 32; ++n) {
+      odd[n] = uint32_t{ 1 } << (n - 1);
+    }
+    square(even, odd); // two zero bits
+    square(odd, even); // four
+    const uint32_t* op = odd;
+    for (;;) {
+      square(even, odd); // one zero byte in the first round
+      op = even;
+      len >>= 1;
+      if (len == 0) {
+        break;
+      }
+      square(odd, even);
+      op = odd;
+      len >>= 1;
+      if (len == 0) {
+        break;
+      }
+    }
+    for (uint32_t n = 0; n < 256; ++n) {
+      table[0][n] = times(op, n);
+      table[1][n] = times(op, n << 8);
+      table[2][n] = times(op, n << 16);
+      table[3][n] = times(op, n << 24);
+    }
+  }
+};
+
+inline const Crc32cTables& crc32cTables() noexcept
+{
+  static const Crc32cTables tables;
+  return tables;
+}
+
+inline uint32_t crc32cShift(const uint32_t (&table)[4][256], uint32_t crc) noexcept
+{
+  return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^ table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+}
+
+//__________________________________________________________________________________________________
+inline uint32_t crc32cSoftware(uint32_t crc, const byte* next, size_t len) noexcept
+{
+  const auto& t = crc32cTables().slice;
+  crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  for (; len > 0 && reinterpret_cast<uintptr_t>(next) & 7; --len) {
+    crc = t[0][(crc ^ static_cast<uint8_t>(*next++)) & 0xff] ^ (crc >> 8);
+  }
+  for (; len >= 8; len -= 8, next += 8) {
+    uint64_t word;
+    std::memcpy(&word, next, sizeof(word));
+    word ^= crc;
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^ t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+          t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^ t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+  }
+#endif
+  for (; len > 0; --len) {
+    crc = t[0][(crc ^ static_cast<uint8_t>(*next++)) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+#if defined(__x86_64__)
+//__________________________________________________________________________________________________
+/// The crc32 instruction has a latency of three cycles and a throughput of one, so large buffers are cut into
+/// three blocks checksummed side by side, their CRCs are combined with the zero byte operators afterwards.
+__attribute__((target("sse4.2"))) inline uint64_t crc32cInterleaved(uint64_t crc0, const byte*& next, size_t& len,
+                                                                    size_t block,
+                                                                    const uint32_t (&shift)[4][256]) noexcept
+{
+  for (; len >= 3 * block; len -= 3 * block) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    for (const byte* end = next + block; next < end; next += 8) {
+      uint64_t words[3];
+      std::memcpy(&words[0], next, 8);
+      std::memcpy(&words[1], next + block, 8);
+      std::memcpy(&words[2], next + 2 * block, 8);
+      crc0 = _mm_crc32_u64(crc0, words[0]);
+      crc1 = _mm_crc32_u64(crc1, words[1]);
+      crc2 = _mm_crc32_u64(crc2, words[2]);
+    }
+    crc0 = crc32cShift(shift, static_cast<uint32_t>(crc0)) ^ crc1;
+    crc0 = crc32cShift(shift, static_cast<uint32_t>(crc0)) ^ crc2;
+    next += 2 * block;
+  }
+  return crc0;
+}
+
+__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(uint32_t crc, const byte* next, size_t len) noexcept
+{
+  uint64_t crc0 = ~crc;
+  for (; len > 0 && reinterpret_cast<uintptr_t>(next) & 7; --len) {
+    crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), static_cast<uint8_t>(*next++));
+  }
+  if (len >= 3 * crc32cShortBlock) {
+    const Crc32cTables& tables = crc32cTables();
+    crc0 = crc32cInterleaved(crc0, next, len, crc32cLongBlock, tables.shiftLong);
+    crc0 = crc32cInterleaved(crc0, next, len, crc32cShortBlock, tables.shiftShort);
+  }
+  for (; len >= 8; len -= 8, next += 8) {
+    uint64_t word;
+    std::memcpy(&word, next, sizeof(word));
+    crc0 = _mm_crc32_u64(crc0, word);
+  }
+  for (; len > 0; --len) {
+    crc0 = _mm_crc32_u8(static_cast<uint32_t>(crc0), static_cast<uint8_t>(*next++));
+  }
+  return ~static_cast<uint32_t>(crc0);
+}
+
+inline bool haveCrc32cInstruction() noexcept
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse4.2");
+}
+#endif
+} // namespace internal
+
+//__________________________________________________________________________________________________
+/// CRC32C (Castagnoli) of len bytes, continuing crc, the CRC of the data before (0 to start)
+inline uint32_t crc32c(uint32_t crc, const void* data, size_t len) noexcept
+{
+#if defined(__x86_64__)
+  static const bool hardware = internal::haveCrc32cInstruction();
+  if (hardware) {
+    return internal::crc32cHardware(crc, static_cast<const byte*>(data), len);
+  }
+#endif
+  return internal::crc32cSoftware(crc, static_cast<const byte*>(data), len);
+}
+
+//__________________________________________________________________________________________________
+/// What validate() found wrong first.
+enum class ValidationStatus {
+  Ok,
+  Truncated,     // a header, or the header it announces, does not fit into the buffer
+  BadMagic,      // not a header
+  BadSize,       // headerSize smaller than a BaseHeader or not a multiple of its alignment
+  Misaligned,    // the buffer cannot hold headers in place
+  TrailingBytes, // the buffer goes on after the last header
+  NoDataHeader,  // needed for the checksum
+  BadChecksum    // the payload or the headers do not match the checksum of the DataHeader, or an unknown checksum type
+};
+
+inline const char* describe(ValidationStatus status) noexcept
+{
+  switch (status) {
+    case ValidationStatus::Ok:
+      return "ok";
+    case ValidationStatus::Truncated:
+      return "truncated header chain";
+    case ValidationStatus::BadMagic:
+      return "bad header magic";
+    case ValidationStatus::BadSize:
+      return "bad header size";
+    case ValidationStatus::Misaligned:
+      return "misaligned header buffer";
+    case ValidationStatus::TrailingBytes:
+      return "bytes after the last header";
+    case ValidationStatus::NoDataHeader:
+      return "no DataHeader";
+    case ValidationStatus::BadChecksum:
+      return "checksum mismatch";
+  }
+  return "unknown";
+}
+
+//__________________________________________________________________________________________________
+/// Check the whole chain of headers in the len bytes of buffer: every header is complete, has the magic and a sane
+/// size, and the last one ends exactly at the end of the buffer. If this is Ok, next() and get() are safe on it.
+inline ValidationStatus validateHeaders(const byte* buffer, size_t len) noexcept
+{
+  if (reinterpret_cast<uintptr_t>(buffer) % alignof(BaseHeader) != 0) {
+    return ValidationStatus::Misaligned;
+  }
+  size_t offset = 0;
+  for (;;) {
+    const size_t left = len - offset;
+    if (!buffer || left < sizeof(BaseHeader)) {
+      return ValidationStatus::Truncated;
+    }
+    const BaseHeader* h = reinterpret_cast<const BaseHeader*>(buffer + offset);
+    if (std::memcmp(h->magic, "O2O2", 4) != 0) {
+      return ValidationStatus::BadMagic;
+    }
+    if (h->headerSize < sizeof(BaseHeader) || h->headerSize % alignof(BaseHeader) != 0) {
+      return ValidationStatus::BadSize;
+    }
+    if (h->headerSize > left) {
+      return ValidationStatus::Truncated;
+    }
+    offset += h->headerSize;
+    if (!h->flagsNextHeader) {
+      return offset == len ? ValidationStatus::Ok : ValidationStatus::TrailingBytes;
+    }
+  }
+}
+
+/// The checksum seal() stores in dataHeader, a header of the stack in the len bytes of headers: the CRC32C of the
+/// stack, with the checksum field taken as zero, followed by the payload. The stack must be valid.
+inline uint32_t stackChecksum(const byte* headers, size_t len, const DataHeader& dataHeader, const void* payload,
+                              size_t payloadLen) noexcept
+{
+  const size_t field = reinterpret_cast<const byte*>(&dataHeader.checksum) - headers;
+  const uint32_t zero = 0;
+  uint32_t crc = crc32c(0, headers, field);
+  crc = crc32c(crc, &zero, sizeof(zero));
+  crc = crc32c(crc, headers + field + sizeof(zero), len - field - sizeof(zero));
+  return crc32c(crc, payload, payloadLen);
+}
+
+/// Validate the header stack and, if its DataHeader carries one, the checksum over the stack and the payload.
+inline ValidationStatus validate(const byte* headers, size_t len, const void* payload, size_t payloadLen) noexcept
+{
+  ValidationStatus status = validateHeaders(headers, len);
+  if (status != ValidationStatus::Ok) {
+    return status;
+  }
+  const DataHeader* dataHeader = get<DataHeader>(headers, len);
+  if (!dataHeader) {
+    return ValidationStatus::NoDataHeader;
+  }
+  switch (dataHeader->checksumType) {
+    case 0:
+      return ValidationStatus::Ok;
+    case 1:
+      return stackChecksum(headers, len, *dataHeader, payload, payloadLen) == dataHeader->checksum
+               ? ValidationStatus::Ok
+               : ValidationStatus::BadChecksum;
+    default:
+      return ValidationStatus::BadChecksum;
+  }
+}
+
+/// Embed the checksum over the header stack and the payload in the DataHeader of the stack. Do it last, any later
+/// change of the headers or the payload is a mismatch for validate().
+inline ValidationStatus seal(byte* headers, size_t len, const void* payload, size_t payloadLen) noexcept
+{
+  ValidationStatus status = validateHeaders(headers, len);
+  if (status != ValidationStatus::Ok) {
+    return status;
+  }
+  DataHeader* dataHeader = get<DataHeader>(headers, len);
+  if (!dataHeader) {
+    return ValidationStatus::NoDataHeader;
+  }
+  dataHeader->checksumType = 1;
+  dataHeader->checksum = stackChecksum(headers, len, *dataHeader, payload, payloadLen);
+  return ValidationStatus::Ok;
+}
+
+//__________________________________________________________________________________________________
+/// the message overloads cover the used size of the messages, which is what the writers of the file transport and
+/// the frame stream record
+inline ValidationStatus validate(const FairMQMessage& header, const FairMQMessage& payload) noexcept
+{
+  return validate(static_cast<const byte*>(header.GetData()), header.GetUsedSize(), payload.GetData(),
+                  payload.GetUsedSize());
+}
+
+inline ValidationStatus seal(FairMQMessage& header, const FairMQMessage& payload) noexcept
+{
+  return seal(static_cast<byte*>(header.GetData()), header.GetUsedSize(), payload.GetData(), payload.GetUsedSize());
+}
+
+/// validate the (header, payload) pairs of an O2Message, the status of the first bad one
+inline ValidationStatus validate(const FairMQParts& parts) noexcept
+{
+  if (parts.fParts.size() % 2 != 0) {
+    return ValidationStatus::Truncated;
+  }
+  for (size_t i = 0; i < parts.fParts.size(); i += 2) {
+    ValidationStatus status = validate(*parts.fParts[i], *parts.fParts[i + 1]);
+    if (status != ValidationStatus::Ok) {
+      return status;
+    }
+  }
+  return ValidationStatus::Ok;
+}